@@ -0,0 +1,460 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// lzw.hpp
+
+// Header-only C++ (C++11 or later) interface to the library. The encoder and decoder
+// are move-only objects that own their contexts, and the data moves through them in
+// chunks by way of the streaming functions (lzw_encoder_feed() and lzw_decoder_feed()),
+// so there are no per-byte callbacks. Sources and sinks are template parameters rather
+// than function pointers, so their code is inlined into the loops here. Any type with
+// these members can be used (the ones provided are below):
+//
+//   source:  size_t fill (const unsigned char *&data);     // bytes available (0 at the end) and where
+//            void consume (size_t count);                  // those bytes have been used (count <= available)
+//
+//   sink:    void write (const unsigned char *data, size_t count);
+//
+// Errors (bad "maxbits", failed malloc(), corrupt or truncated streams, or a span_sink
+// that's too small) throw lzw::error. The decoder never consumes input beyond the end
+// of the stream, so anything after it is left in the source. The library itself is C,
+// so compile lzwlib.c with a C compiler and link it in (it can be compiled together
+// with the application using link-time optimization).
+
+#ifndef LZW_HPP_
+#define LZW_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include "lzwlib.h"
+}
+
+namespace lzw {
+
+#ifndef LZW_HPP_CHUNK
+#define LZW_HPP_CHUNK 16384     // size of the output (and non-contiguous input) chunks
+#endif
+
+class error : public std::runtime_error {
+  public:
+    explicit error (const char *what) : std::runtime_error (what) {}
+};
+
+//////////////////////////////////////////// sources ////////////////////////////////////////////
+
+// Contiguous data in memory (also a std::vector or std::string), which is used directly.
+
+class span_source {
+    const unsigned char *data_;
+    size_t size_;
+
+  public:
+    span_source (const void *data, size_t size) : data_ (static_cast<const unsigned char *> (data)), size_ (size) {}
+
+    template <class Container>
+    explicit span_source (const Container &container) :
+        data_ (reinterpret_cast<const unsigned char *> (container.data ())), size_ (container.size () * sizeof (container [0])) {}
+
+    size_t fill (const unsigned char *&data) { data = data_; return size_; }
+    void consume (size_t count) { data_ += count; size_ -= count; }
+
+    const unsigned char *data () const { return data_; }        // whatever hasn't been consumed
+    size_t size () const { return size_; }
+};
+
+// Any input iterator range of byte values, copied through a buffer (contiguous iterators are
+// better handled with span_source).
+
+template <class InputIt>
+class iterator_source {
+    InputIt first_, last_;
+    unsigned char buffer_ [LZW_HPP_CHUNK];
+    size_t index_, count_;
+
+  public:
+    iterator_source (InputIt first, InputIt last) : first_ (first), last_ (last), index_ (0), count_ (0) {}
+
+    size_t fill (const unsigned char *&data)
+    {
+        if (index_ == count_) {
+            for (index_ = count_ = 0; count_ < sizeof (buffer_) && first_ != last_; ++first_)
+                buffer_ [count_++] = static_cast<unsigned char> (*first_);
+        }
+
+        data = buffer_ + index_;
+        return count_ - index_;
+    }
+
+    void consume (size_t count) { index_ += count; }
+};
+
+template <class InputIt>
+iterator_source<InputIt> make_iterator_source (InputIt first, InputIt last)
+{
+    return iterator_source<InputIt> (first, last);
+}
+
+// A std::istream (opened in binary mode), read in chunks. Bytes read from the stream but not
+// consumed (past the end of a compressed stream) stay in this object's buffer.
+
+class istream_source {
+    std::istream &stream_;
+    std::vector<unsigned char> buffer_;
+    size_t index_, count_;
+
+  public:
+    explicit istream_source (std::istream &stream) : stream_ (stream), buffer_ (LZW_HPP_CHUNK), index_ (0), count_ (0) {}
+
+    size_t fill (const unsigned char *&data)
+    {
+        if (index_ == count_) {
+            stream_.read (reinterpret_cast<char *> (&buffer_ [0]), buffer_.size ());
+            count_ = static_cast<size_t> (stream_.gcount ());
+            index_ = 0;
+        }
+
+        data = &buffer_ [index_];
+        return count_ - index_;
+    }
+
+    void consume (size_t count) { index_ += count; }
+};
+
+///////////////////////////////////////////// sinks /////////////////////////////////////////////
+
+// A fixed area of memory. Overflowing it throws lzw::error (and nothing past the end is written).
+
+class span_sink {
+    unsigned char *data_;
+    size_t capacity_, size_;
+
+  public:
+    span_sink (void *data, size_t capacity) : data_ (static_cast<unsigned char *> (data)), capacity_ (capacity), size_ (0) {}
+
+    void write (const unsigned char *data, size_t count)
+    {
+        if (count > capacity_ - size_)
+            throw error ("lzw: output does not fit");
+
+        std::memcpy (data_ + size_, data, count);
+        size_ += count;
+    }
+
+    size_t size () const { return size_; }      // bytes written so far
+};
+
+// Appends to a std::vector of bytes (in chunks, rather than a byte at a time like a back_inserter).
+
+template <class Byte>
+class basic_vector_sink {
+    std::vector<Byte> &vector_;
+
+  public:
+    explicit basic_vector_sink (std::vector<Byte> &vector) : vector_ (vector) {}
+
+    void write (const unsigned char *data, size_t count) { vector_.insert (vector_.end (), data, data + count); }
+};
+
+typedef basic_vector_sink<unsigned char> vector_sink;
+
+// Any output iterator (including std::back_inserter() for other containers).
+
+template <class OutputIt>
+class iterator_sink {
+    OutputIt out_;
+
+  public:
+    explicit iterator_sink (OutputIt out) : out_ (out) {}
+
+    void write (const unsigned char *data, size_t count) { out_ = std::copy (data, data + count, out_); }
+
+    OutputIt position () const { return out_; }     // one past the last byte written
+};
+
+template <class OutputIt>
+iterator_sink<OutputIt> make_iterator_sink (OutputIt out)
+{
+    return iterator_sink<OutputIt> (out);
+}
+
+// A std::ostream (opened in binary mode). A failed write throws lzw::error.
+
+class ostream_sink {
+    std::ostream &stream_;
+
+  public:
+    explicit ostream_sink (std::ostream &stream) : stream_ (stream) {}
+
+    void write (const unsigned char *data, size_t count)
+    {
+        if (!stream_.write (reinterpret_cast<const char *> (data), count))
+            throw error ("lzw: error writing output stream");
+    }
+};
+
+////////////////////////////////////////// dictionaries //////////////////////////////////////////
+
+// An owned preset dictionary (see lzwlib.h), which can be shared (const) by any number of
+// encoders and decoders (and threads), but must outlive them.
+
+class dictionary {
+    lzw_dictionary_t *dictionary_;
+
+    explicit dictionary (lzw_dictionary_t *created) : dictionary_ (created)
+    {
+        if (!dictionary_)
+            throw error ("lzw: can't create dictionary");
+    }
+
+  public:
+    dictionary (const void *content, size_t content_size, int maxbits, unsigned int id) :
+        dictionary (lzw_dictionary_create (content, content_size, maxbits, id)) {}
+
+    static dictionary load (const void *file_data, size_t file_size)    // (the file isn't referenced after this)
+    {
+        return dictionary (lzw_dictionary_load (file_data, file_size));
+    }
+
+    dictionary (dictionary &&other) noexcept : dictionary_ (other.dictionary_) { other.dictionary_ = nullptr; }
+
+    dictionary &operator= (dictionary &&other) noexcept
+    {
+        std::swap (dictionary_, other.dictionary_);
+        return *this;
+    }
+
+    dictionary (const dictionary &) = delete;
+    dictionary &operator= (const dictionary &) = delete;
+
+    ~dictionary () { if (dictionary_) lzw_dictionary_free (dictionary_); }
+
+    const lzw_dictionary_t *get () const { return dictionary_; }
+};
+
+//////////////////////////////////////////// encoder /////////////////////////////////////////////
+
+// The contexts hold no pointers into themselves, so a move is a plain copy of the structure
+// (leaving the zeroed original with nothing to free).
+
+class encoder {
+    lzw_encoder_t enc_;
+
+    template <class Sink, class Function>
+    void drain (Sink &sink, Function function, const char *what)
+    {
+        unsigned char buffer [LZW_HPP_CHUNK];
+        int res;
+
+        do {
+            size_t out = sizeof (buffer);
+
+            if ((res = function (&enc_, buffer, &out)) == LZW_ERROR)
+                throw error (what);
+
+            sink.write (buffer, out);
+        } while (res != LZW_DONE);
+    }
+
+  public:
+    explicit encoder (int maxbits = 16)
+    {
+        if (lzw_encoder_init (&enc_, maxbits))
+            throw error ("lzw: can't initialize encoder");
+    }
+
+    explicit encoder (const dictionary &dict)
+    {
+        if (lzw_encoder_init_dict (&enc_, dict.get ()))
+            throw error ("lzw: can't initialize encoder");
+    }
+
+    encoder (encoder &&other) noexcept : enc_ (other.enc_) { std::memset (&other.enc_, 0, sizeof (other.enc_)); }
+
+    encoder &operator= (encoder &&other) noexcept
+    {
+        std::swap (enc_, other.enc_);
+        return *this;
+    }
+
+    encoder (const encoder &) = delete;
+    encoder &operator= (const encoder &) = delete;
+
+    ~encoder () { lzw_encoder_free (&enc_); }
+
+    // allow flush() in this stream (must be called first, see lzw_encoder_allow_flush())
+
+    void allow_flush ()
+    {
+        if (lzw_encoder_allow_flush (&enc_))
+            throw error ("lzw: too late to allow flushing");
+    }
+
+    // compress everything in the source (which can be called any number of times)
+
+    template <class Source, class Sink>
+    void feed (Source &&source, Sink &&sink)
+    {
+        unsigned char buffer [LZW_HPP_CHUNK];
+        const unsigned char *data;
+        size_t available;
+
+        while ((available = source.fill (data)) != 0) {
+            size_t in = available, out = sizeof (buffer);
+
+            if (lzw_encoder_feed (&enc_, data, &in, buffer, &out) == LZW_ERROR)
+                throw error ("lzw: encoder error");
+
+            source.consume (in);
+            sink.write (buffer, out);
+        }
+    }
+
+    // make everything fed so far decodable right away (see lzw_encoder_flush())
+
+    template <class Sink>
+    void flush (Sink &&sink)
+    {
+        drain (sink, lzw_encoder_flush, "lzw: can't flush");
+    }
+
+    // terminate the stream (after which nothing more can be fed)
+
+    template <class Sink>
+    void finish (Sink &&sink)
+    {
+        drain (sink, lzw_encoder_finish, "lzw: encoder error");
+    }
+};
+
+//////////////////////////////////////////// decoder /////////////////////////////////////////////
+
+class decoder {
+    lzw_decoder_t dec_;
+    bool done_;
+
+  public:
+    decoder () : done_ (false)
+    {
+        if (lzw_decoder_init (&dec_))
+            throw error ("lzw: can't initialize decoder");
+    }
+
+    explicit decoder (const dictionary &dict) : done_ (false)
+    {
+        if (lzw_decoder_init_dict (&dec_, dict.get ()))
+            throw error ("lzw: can't initialize decoder");
+    }
+
+    decoder (decoder &&other) noexcept : dec_ (other.dec_), done_ (other.done_) { std::memset (&other.dec_, 0, sizeof (other.dec_)); }
+
+    decoder &operator= (decoder &&other) noexcept
+    {
+        std::swap (dec_, other.dec_);
+        std::swap (done_, other.done_);
+        return *this;
+    }
+
+    decoder (const decoder &) = delete;
+    decoder &operator= (const decoder &) = delete;
+
+    ~decoder () { lzw_decoder_finish (&dec_); }
+
+    // decompress whatever the source has, returning true once the end of the stream has been
+    // reached (and everything sent), or false if it needs more input (which can be fed later)
+
+    template <class Source, class Sink>
+    bool feed (Source &&source, Sink &&sink)
+    {
+        unsigned char buffer [LZW_HPP_CHUNK];
+        const unsigned char *data;
+
+        while (!done_) {
+            size_t available = source.fill (data), in = available, out = sizeof (buffer);
+            int res = lzw_decoder_feed (&dec_, data, &in, buffer, &out);
+
+            if (res == LZW_ERROR)
+                throw error ("lzw: corrupt stream");
+
+            source.consume (in);
+            sink.write (buffer, out);
+            done_ = res == LZW_DONE;
+
+            if (!available && !out)
+                break;
+        }
+
+        return done_;
+    }
+
+    bool done () const { return done_; }
+};
+
+////////////////////////////////////// complete streams //////////////////////////////////////
+
+template <class Source, class Sink>
+void compress (Source &&source, Sink &&sink, int maxbits = 16)
+{
+    encoder enc (maxbits);
+    enc.feed (source, sink);
+    enc.finish (sink);
+}
+
+template <class Source, class Sink>
+void compress (Source &&source, Sink &&sink, const dictionary &dict)
+{
+    encoder enc (dict);
+    enc.feed (source, sink);
+    enc.finish (sink);
+}
+
+template <class Source, class Sink>
+void decompress (Source &&source, Sink &&sink)
+{
+    if (!decoder ().feed (source, sink))
+        throw error ("lzw: truncated stream");
+}
+
+template <class Source, class Sink>
+void decompress (Source &&source, Sink &&sink, const dictionary &dict)
+{
+    if (!decoder (dict).feed (source, sink))
+        throw error ("lzw: truncated stream");
+}
+
+// Memory to std::vector conveniences. Compression uses lzw_compress_buffer() (sized with
+// lzw_compress_bound()), which writes straight into the vector.
+
+inline std::vector<unsigned char> compress_buffer (const void *data, size_t size, int maxbits = 16)
+{
+    std::vector<unsigned char> output (lzw_compress_bound (size, maxbits));
+    size_t output_size = output.size ();
+
+    if (lzw_compress_buffer (&output [0], &output_size, data, size, maxbits))
+        throw error ("lzw: encoder error");
+
+    output.resize (output_size);
+    return output;
+}
+
+inline std::vector<unsigned char> decompress_buffer (const void *data, size_t size)
+{
+    std::vector<unsigned char> output;
+    decompress (span_source (data, size), vector_sink (output));
+    return output;
+}
+
+} // namespace lzw
+
+#endif /* LZW_HPP_ */
@@ -0,0 +1,574 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAVE_RDTSC
+#endif
+
+#include "lzwlib.h"
+
+/* This module provides a command-line benchmark for the lzw library. For each
+ * data set and each maximum symbol size it measures compression and decompression
+ * speed (the best of several runs, in MB/s and cycles per byte), the compression
+ * ratio and the working memory used by the library. The data sets are either files
+ * or deterministic built-in generators (so results are comparable across versions
+ * and machines) which cover the usual extremes. The results are displayed as a
+ * table or as JSON (for tracking regressions with scripts).
+ *
+ * The cycle counts come from the time-stamp counter (on x86 only), which counts at
+ * a constant rate on modern CPUs, so they are "reference" cycles and not affected
+ * by frequency scaling. The memory is what the library itself uses for the tables
+ * (i.e., lzw_workspace_size() of the mode used), not the data buffers.
+ */
+
+static const char *usage =
+" Usage:     lzwbench [options] [file ...]\n\n"
+" Options:   -1 ... -8 = benchmark only specified max symbol size (9 - 16)\n"
+"            -0        = cycle through all maximum symbol sizes (default)\n"
+"            -g        = include the built-in data with files\n"
+"            -s<n>     = size of built-in data in KB (default 4096)\n"
+"            -r<n>     = number of runs (best is reported, default 3)\n"
+"            -c        = use the callback functions (lzw_compress() and\n"
+"                        lzw_decompress()) instead of the buffer functions\n"
+"            -m        = use minimum size workspaces (slower modes)\n"
+"            -j        = display results as JSON instead of a table\n\n"
+" Built-in:  zeros, text, random, mixed (tar-like), executable (x86-like)\n\n"
+" Web:       Visit www.github.com/dbry/lzw-ab for latest version and info\n\n";
+
+#define API_BUFFER      0
+#define API_CALLBACK    1
+
+static double get_seconds (void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+
+    QueryPerformanceFrequency (&frequency);
+    QueryPerformanceCounter (&counter);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static unsigned long long get_cycles (void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+/*------------------------------------------------------------------------------------------------*/
+// the deterministic data generators (all use the same simple PRNG as the tester's fuzzer)
+
+static unsigned long long kernel;
+
+static unsigned int random_bits (int bits)
+{
+    kernel = ((kernel << 4) - kernel) ^ 1;
+    kernel = ((kernel << 4) - kernel) ^ 1;
+    kernel = ((kernel << 4) - kernel) ^ 1;
+    return (unsigned int) (kernel >> (64 - bits));
+}
+
+static const char *words [] = {
+    "the", "of", "and", "to", "a", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+    "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+    "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+    "more", "when", "will", "would", "who", "so", "no", "compression", "dictionary", "string", "code",
+    "symbol", "buffer", "stream", "decoder", "encoder", "value", "table", "entry", "reference"
+};
+
+#define NUM_WORDS (sizeof (words) / sizeof (words [0]))
+
+// English-like text with a skewed (roughly Zipf) word distribution, punctuation and lines
+
+static void gen_text (unsigned char *dst, size_t size)
+{
+    size_t index = 0, line = 0;
+    int capitalize = 1;
+
+    while (index < size) {
+        unsigned int pick = random_bits (12);
+        const char *word = words [(pick * pick >> 12) * NUM_WORDS >> 12];
+        size_t length = strlen (word), i;
+
+        for (i = 0; i < length && index < size; ++i, ++line)
+            dst [index++] = (i || !capitalize) ? word [i] : word [i] - 32;
+
+        capitalize = 0;
+
+        if (index < size) {
+            unsigned int punct = random_bits (4);
+
+            if (punct == 0) {
+                dst [index++] = '.';
+                capitalize = 1;
+            }
+            else if (punct == 1)
+                dst [index++] = ',';
+        }
+
+        if (index < size) {
+            dst [index++] = line > 64 ? '\n' : ' ';
+            line = line > 64 ? 0 : line + 1;
+        }
+    }
+}
+
+static void gen_random (unsigned char *dst, size_t size)
+{
+    while (size--)
+        *dst++ = random_bits (8);
+}
+
+// something like x86 machine code: a small skewed set of opcodes with ModRM bytes and
+// little-endian displacements and addresses (mostly small), plus some zero padding
+
+static void gen_executable (unsigned char *dst, size_t size)
+{
+    static const unsigned char opcodes [] = {
+        0x8b, 0x89, 0x48, 0xe8, 0x83, 0x85, 0x74, 0x75, 0x0f, 0xc3, 0x55, 0x5d, 0x31, 0x39, 0xff, 0x8d
+    };
+    size_t index = 0;
+
+    while (index < size) {
+        unsigned int pick = random_bits (8), op = opcodes [(pick * pick >> 8) * sizeof (opcodes) >> 8];
+        unsigned char insn [8];
+        int length = 0, i;
+
+        insn [length++] = op;
+
+        if (op == 0xe8) {           // call with a 32-bit relative address (mostly nearby)
+            unsigned int rel = random_bits (12) - 2048;
+
+            for (i = 0; i < 4; ++i, rel >>= 8)
+                insn [length++] = rel;
+        }
+        else if (op != 0xc3 && op != 0x55 && op != 0x5d) {
+            insn [length++] = 0x40 + (random_bits (3) << 3) + random_bits (2);  // ModRM
+
+            if (random_bits (2))
+                insn [length++] = random_bits (3) << 3;     // small aligned displacement
+        }
+
+        if (op == 0xc3 && random_bits (1))     // pad to the next 16 bytes after a return
+            while (((index + length) & 15) && length < (int) sizeof (insn))
+                insn [length++] = 0;
+
+        for (i = 0; i < length && index < size; ++i)
+            dst [index++] = insn [i];
+    }
+}
+
+// something like a tar file: 512-byte headers (mostly zero) followed by files
+// of the other types, each padded with zeros to a multiple of 512 bytes
+
+static void gen_mixed (unsigned char *dst, size_t size)
+{
+    size_t index = 0;
+    int file = 0;
+
+    while (index < size) {
+        size_t file_size = (random_bits (16) + 1) * 4, padded = (file_size + 511) & ~(size_t) 511;
+
+        if (size - index < 512)
+            file_size = padded = 0;
+
+        memset (dst + index, 0, size - index < 512 + padded ? size - index : 512 + padded);
+
+        if (size - index >= 512) {
+            sprintf ((char *) dst + index, "data/file%04d.bin", file++);
+            sprintf ((char *) dst + index + 100, "0000644%c0001750%c0001750%c%011o%c%011o",
+                0, 0, 0, (unsigned int) file_size, 0, 1234567890U + file);
+            memcpy (dst + index + 257, "ustar  ", 8);
+        }
+
+        index += size - index < 512 ? size - index : 512;
+
+        if (file_size > size - index)
+            file_size = size - index;
+
+        switch (random_bits (2)) {
+            case 0: gen_text (dst + index, file_size); break;
+            case 1: gen_random (dst + index, file_size); break;
+            case 2: gen_executable (dst + index, file_size); break;
+        }
+
+        index += padded > size - index ? size - index : padded;
+    }
+}
+
+static void gen_zeros (unsigned char *dst, size_t size)
+{
+    memset (dst, 0, size);
+}
+
+static struct {
+    const char *name;
+    void (*generate)(unsigned char *, size_t);
+} generators [] = {
+    { "zeros", gen_zeros }, { "text", gen_text }, { "random", gen_random },
+    { "mixed", gen_mixed }, { "executable", gen_executable }
+};
+
+#define NUM_GENERATORS (sizeof (generators) / sizeof (generators [0]))
+
+/*------------------------------------------------------------------------------------------------*/
+// memory streams for the callback functions
+
+typedef struct {
+    unsigned char *buffer;
+    size_t size, index;
+} streamer;
+
+static int read_buff (void *ctx)
+{
+    streamer *stream = ctx;
+
+    return stream->index < stream->size ? stream->buffer [stream->index++] : EOF;
+}
+
+static void write_buff (int value, void *ctx)
+{
+    streamer *stream = ctx;
+
+    if (stream->index < stream->size)
+        stream->buffer [stream->index] = value;
+
+    stream->index++;
+}
+
+typedef struct {
+    double comp_seconds, decomp_seconds;
+    unsigned long long comp_cycles, decomp_cycles;
+    size_t packed_size, comp_memory, decomp_memory;
+} results_t;
+
+// compress and decompress the data "runs" times, keeping the best times, and verify it (returns non-zero on error)
+
+static int benchmark (const unsigned char *data, size_t size, int maxbits, int runs, int api, int minimum, results_t *results)
+{
+    size_t packed_alloc = lzw_compress_bound (size, maxbits), comp_memory, decomp_memory;
+    unsigned char *packed = malloc (packed_alloc), *check = malloc (size ? size : 1);
+    void *comp_workspace = NULL, *decomp_workspace = NULL;
+    int error = 0, run;
+
+    // these are the modes that the allocating functions use (see lzwlib.c)
+
+    comp_memory = lzw_workspace_size (maxbits, minimum ? LZW_ENCODER : LZW_HASH_ENCODER);
+    decomp_memory = lzw_workspace_size (maxbits, (minimum || api == API_CALLBACK) ? LZW_DECODER : LZW_BUFFER_DECODER);
+
+    if (minimum) {
+        comp_workspace = malloc (comp_memory);
+        decomp_workspace = malloc (decomp_memory);
+    }
+
+    if (!packed || !check || (minimum && (!comp_workspace || !decomp_workspace))) {
+        free (decomp_workspace);
+        free (comp_workspace);
+        free (packed);
+        free (check);
+        return 1;
+    }
+
+    memset (results, 0, sizeof (results_t));
+    results->comp_memory = comp_memory;
+    results->decomp_memory = decomp_memory;
+
+    for (run = 0; run < runs && !error; ++run) {
+        size_t packed_size = packed_alloc, check_size = size;
+        unsigned long long cycles;
+        double seconds;
+
+        seconds = get_seconds ();
+        cycles = get_cycles ();
+
+        if (api == API_CALLBACK) {
+            streamer reader = { (unsigned char *) data, size, 0 }, writer = { packed, packed_alloc, 0 };
+
+            error = minimum ? lzw_compress_ws (write_buff, &writer, read_buff, &reader, maxbits, comp_workspace, comp_memory) :
+                lzw_compress (write_buff, &writer, read_buff, &reader, maxbits);
+
+            packed_size = writer.index;
+            error = error || packed_size > packed_alloc;
+        }
+        else
+            error = minimum ? lzw_compress_buffer_ws (packed, &packed_size, data, size, maxbits, comp_workspace, comp_memory) :
+                lzw_compress_buffer (packed, &packed_size, data, size, maxbits);
+
+        cycles = get_cycles () - cycles;
+        seconds = get_seconds () - seconds;
+
+        if (!run || seconds < results->comp_seconds)
+            results->comp_seconds = seconds;
+
+        if (!run || cycles < results->comp_cycles)
+            results->comp_cycles = cycles;
+
+        results->packed_size = packed_size;
+
+        if (error)
+            break;
+
+        seconds = get_seconds ();
+        cycles = get_cycles ();
+
+        if (api == API_CALLBACK) {
+            streamer reader = { packed, packed_size, 0 }, writer = { check, size, 0 };
+
+            error = minimum ? lzw_decompress_ws (write_buff, &writer, read_buff, &reader, decomp_workspace, decomp_memory) :
+                lzw_decompress (write_buff, &writer, read_buff, &reader);
+
+            check_size = writer.index;
+        }
+        else
+            error = minimum ? lzw_decompress_buffer_ws (check, &check_size, packed, packed_size, decomp_workspace, decomp_memory) :
+                lzw_decompress_buffer (check, &check_size, packed, packed_size);
+
+        cycles = get_cycles () - cycles;
+        seconds = get_seconds () - seconds;
+
+        if (!run || seconds < results->decomp_seconds)
+            results->decomp_seconds = seconds;
+
+        if (!run || cycles < results->decomp_cycles)
+            results->decomp_cycles = cycles;
+
+        error = error || check_size != size || memcmp (check, data, size);
+    }
+
+    free (decomp_workspace);
+    free (comp_workspace);
+    free (packed);
+    free (check);
+    return error;
+}
+
+static double mb_per_second (size_t size, double seconds)
+{
+    return seconds > 0.0 ? size / seconds / 1e6 : 0.0;
+}
+
+static void print_result (const char *name, size_t size, int maxbits, const results_t *results, int json, int *count)
+{
+    double ratio = size ? results->packed_size * 100.0 / size : 0.0;
+
+    if (json) {
+        printf ("%s\n  { \"data\": \"", (*count)++ ? "," : "[");
+
+        for (; *name; ++name)
+            if (*name == '"' || *name == '\\')
+                printf ("\\%c", *name);
+            else if ((unsigned char) *name >= ' ')
+                putchar (*name);
+
+        printf ("\", \"size\": %lu, \"maxbits\": %d, \"compressed_size\": %lu, \"ratio\": %.4f,\n",
+            (unsigned long) size, maxbits, (unsigned long) results->packed_size, ratio);
+        printf ("    \"compress_mbps\": %.3f, \"compress_ms\": %.3f, ", mb_per_second (size, results->comp_seconds), results->comp_seconds * 1000.0);
+
+#ifdef HAVE_RDTSC
+        printf ("\"compress_cycles_per_byte\": %.3f,\n", size ? (double) results->comp_cycles / size : 0.0);
+#else
+        printf ("\"compress_cycles_per_byte\": null,\n");
+#endif
+        printf ("    \"decompress_mbps\": %.3f, \"decompress_ms\": %.3f, ", mb_per_second (size, results->decomp_seconds), results->decomp_seconds * 1000.0);
+
+#ifdef HAVE_RDTSC
+        printf ("\"decompress_cycles_per_byte\": %.3f,\n", size ? (double) results->decomp_cycles / size : 0.0);
+#else
+        printf ("\"decompress_cycles_per_byte\": null,\n");
+#endif
+        printf ("    \"compress_memory\": %lu, \"decompress_memory\": %lu }",
+            (unsigned long) results->comp_memory, (unsigned long) results->decomp_memory);
+    }
+    else {
+        const char *label = name, *cp;
+
+        // a file is shown by its name without the path (and only the end of a long one) so the rows can be told apart
+
+        for (cp = name; *cp; ++cp)
+            if (*cp == '/' || *cp == '\\')
+                label = cp + 1;
+
+        if (strlen (label) > 16)
+            label += strlen (label) - 16;
+
+        if (!(*count)++) {
+            printf ("data                    size  bits    ratio   comp MB/s  cyc/B  decomp MB/s  cyc/B  comp mem  decomp mem\n");
+            printf ("--------------------------------------------------------------------------------------------------------\n");
+        }
+
+        printf ("%-16.16s %11lu  %4d  %6.2f%%  %10.2f  %5.1f  %11.2f  %5.1f  %6lu K  %8lu K\n", label,
+            (unsigned long) size, maxbits, ratio,
+            mb_per_second (size, results->comp_seconds), size ? (double) results->comp_cycles / size : 0.0,
+            mb_per_second (size, results->decomp_seconds), size ? (double) results->decomp_cycles / size : 0.0,
+            (unsigned long) (results->comp_memory + 1023) / 1024, (unsigned long) (results->decomp_memory + 1023) / 1024);
+    }
+}
+
+static int run_benchmarks (const char *name, const unsigned char *data, size_t size, int set_maxbits, int runs, int api, int minimum, int json, int *count)
+{
+    int maxbits, errors = 0;
+    results_t results;
+
+    for (maxbits = set_maxbits ? set_maxbits : 9; maxbits <= (set_maxbits ? set_maxbits : 16); ++maxbits)
+        if (benchmark (data, size, maxbits, runs, api, minimum, &results)) {
+            fprintf (stderr, "error on %s with maxbits = %d (failed malloc() or bad round trip)!\n", name, maxbits);
+            errors++;
+        }
+        else
+            print_result (name, size, maxbits, &results, json, count);
+
+    return errors;
+}
+
+int main (int argc, char **argv)
+{
+    int set_maxbits = 0, runs = 3, api = API_BUFFER, minimum = 0, json = 0, builtin = 0, files = 0, errors = 0, count = 0;
+    long builtin_size = 4096 * 1024L;
+    unsigned char *data;
+    char *end;
+    int index;
+
+    // first pass is just options (and counting files)
+
+    for (index = 1; index < argc; ++index) {
+        char *arg = argv [index];
+
+        if (*arg != '-' || !arg [1]) {
+            files++;
+            continue;
+        }
+
+        while (*++arg)
+            switch (*arg) {
+                case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8':
+                    set_maxbits = *arg == '0' ? 0 : *arg - '0' + 8;
+                    break;
+
+                case 'C': case 'c':
+                    api = API_CALLBACK;
+                    break;
+
+                case 'G': case 'g':
+                    builtin = 1;
+                    break;
+
+                case 'J': case 'j':
+                    json = 1;
+                    break;
+
+                case 'M': case 'm':
+                    minimum = 1;
+                    break;
+
+                case 'R': case 'r':
+                    runs = strtol (arg + 1, &end, 10);
+
+                    if (end == arg + 1 || runs < 1) {
+                        fprintf (stderr, "invalid number of runs!\n");
+                        return 1;
+                    }
+
+                    arg = end - 1;
+                    break;
+
+                case 'S': case 's':
+                    builtin_size = strtol (arg + 1, &end, 10) * 1024;
+
+                    if (end == arg + 1 || builtin_size < 1 || builtin_size > 1024L * 1024L * 1024L) {
+                        fprintf (stderr, "invalid size!\n");
+                        return 1;
+                    }
+
+                    arg = end - 1;
+                    break;
+
+                case 'H': case 'h':
+                    printf ("%s", usage);
+                    return 0;
+
+                default:
+                    fprintf (stderr, "illegal option: %c !\n%s", *arg, usage);
+                    return 1;
+            }
+    }
+
+    if (!files || builtin) {
+        size_t i;
+
+        if (!(data = malloc (builtin_size))) {
+            fprintf (stderr, "can't allocate built-in data!\n");
+            return 1;
+        }
+
+        for (i = 0; i < NUM_GENERATORS; ++i) {
+            kernel = 0x3141592653589793;
+            generators [i].generate (data, builtin_size);
+            errors += run_benchmarks (generators [i].name, data, builtin_size, set_maxbits, runs, api, minimum, json, &count);
+        }
+
+        free (data);
+    }
+
+    for (index = 1; index < argc; ++index) {
+        const char *filename = argv [index];
+        long file_size;
+        FILE *infile;
+
+        if (*filename == '-' && filename [1])
+            continue;
+
+        if (!(infile = fopen (filename, "rb")) || fseek (infile, 0, SEEK_END) || (file_size = ftell (infile)) <= 0 ||
+            file_size > 1024L * 1024L * 1024L || fseek (infile, 0, SEEK_SET)) {
+                fprintf (stderr, "can't open file %s (or it's empty or too big)!\n", filename);
+                if (infile) fclose (infile);
+                errors++;
+                continue;
+        }
+
+        if (!(data = malloc (file_size)) || fread (data, 1, file_size, infile) != (size_t) file_size) {
+            fprintf (stderr, "can't read file %s!\n", filename);
+            fclose (infile);
+            free (data);
+            errors++;
+            continue;
+        }
+
+        fclose (infile);
+        errors += run_benchmarks (filename, data, file_size, set_maxbits, runs, api, minimum, json, &count);
+        free (data);
+    }
+
+    if (json)
+        printf ("%s]\n", count ? "\n" : "[");
+
+    return errors ? 1 : 0;
+}
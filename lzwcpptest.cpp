@@ -0,0 +1,323 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+// lzwcpptest.cpp
+
+// This is the test program for the C++ wrapper (lzw.hpp), built like any application
+// that uses it (lzwlib.c is compiled as C and linked in). It round-trips data through
+// every kind of source and sink, checks that the output matches the C functions, moves
+// encoders and decoders in the middle of streams, flushes, uses a preset dictionary,
+// and checks that truncated, corrupt and overflowing cases throw lzw::error. The data
+// is built in (deterministic "text" and noise), plus any files given on the command line.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <list>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lzw.hpp"
+
+typedef std::vector<unsigned char> bytes;
+
+static int tests, errors;
+
+static void check (bool passed, const char *what, const char *name, int maxbits)
+{
+    tests++;
+
+    if (!passed) {
+        std::printf ("%s failed on %s, maxbits = %d\n", what, name, maxbits);
+        errors++;
+    }
+}
+
+// run "function" and return true only if it throws lzw::error
+
+template <class Function>
+static bool throws (Function function)
+{
+    try {
+        function ();
+    }
+    catch (const lzw::error &) {
+        return true;
+    }
+
+    return false;
+}
+
+// words from a small vocabulary with a bit of noise (so it compresses, but not trivially)
+
+static bytes generate_data (size_t size, unsigned long long kernel)
+{
+    static const char *words [] = { "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ",
+        "{\"id\": ", "\"name\": ", "\"value\": ", "}, ", "\n", "0123", "lzw ", "adjusted binary " };
+    bytes data;
+
+    while (data.size () < size) {
+        kernel = ((kernel << 4) - kernel) ^ 1;
+
+        if ((kernel >> 60) == 0)
+            data.push_back (static_cast<unsigned char> (kernel >> 32));
+        else {
+            const char *word = words [(kernel >> 40) & 15];
+            data.insert (data.end (), word, word + std::strlen (word));
+        }
+    }
+
+    data.resize (size);
+    return data;
+}
+
+// the C library's output, which every way of compressing through the wrapper should match
+
+static bytes c_compress (const bytes &data, int maxbits)
+{
+    size_t size = lzw_compress_bound (data.size (), maxbits);
+    bytes stream (size + 1);
+
+    if (lzw_compress_buffer (&stream [0], &size, data.empty () ? NULL : &data [0], data.size (), maxbits))
+        return bytes ();
+
+    stream.resize (size);
+    return stream;
+}
+
+static void source_sink_tests (const bytes &data, const char *name, int maxbits)
+{
+    const bytes expected = c_compress (data, maxbits);
+    bytes stream, output;
+
+    // memory to memory (and the conveniences)
+
+    stream = lzw::compress_buffer (data.empty () ? NULL : &data [0], data.size (), maxbits);
+    check (stream == expected, "compress_buffer()", name, maxbits);
+    check (lzw::decompress_buffer (&stream [0], stream.size ()) == data, "decompress_buffer()", name, maxbits);
+
+    stream.clear ();
+    lzw::compress (lzw::span_source (data), lzw::vector_sink (stream), maxbits);
+    check (stream == expected, "span_source to vector_sink", name, maxbits);
+
+    bytes buffer (data.size () + 1);
+    lzw::span_sink span (&buffer [0], buffer.size ());
+    lzw::decompress (lzw::span_source (stream), span);
+    check (span.size () == data.size () && std::equal (data.begin (), data.end (), buffer.begin ()), "span_sink", name, maxbits);
+
+    // non-contiguous containers through iterators (and a std::string through a back_inserter)
+
+    std::list<unsigned char> list (data.begin (), data.end ());
+    std::deque<char> deque;
+    lzw::compress (lzw::make_iterator_source (list.begin (), list.end ()), lzw::make_iterator_sink (std::back_inserter (deque)), maxbits);
+    check (deque.size () == expected.size () && std::equal (expected.begin (), expected.end (), deque.begin (),
+        [] (unsigned char a, char b) { return a == static_cast<unsigned char> (b); }), "iterator_source to iterator_sink", name, maxbits);
+
+    std::string string;
+    lzw::decompress (lzw::make_iterator_source (deque.begin (), deque.end ()), lzw::make_iterator_sink (std::back_inserter (string)));
+    check (string.size () == data.size () && std::equal (data.begin (), data.end (), string.begin (),
+        [] (unsigned char a, char b) { return a == static_cast<unsigned char> (b); }), "iterator round trip", name, maxbits);
+
+    // iostreams, with something after the compressed stream that the decoder must leave alone
+
+    std::stringstream compressed (std::ios::in | std::ios::out | std::ios::binary);
+    std::istringstream input (std::string (data.begin (), data.end ()), std::ios::binary);
+    lzw::compress (lzw::istream_source (input), lzw::ostream_sink (compressed), maxbits);
+    check (compressed.str () == std::string (expected.begin (), expected.end ()), "istream_source to ostream_sink", name, maxbits);
+
+    std::ostringstream decompressed (std::ios::binary);
+    lzw::decompress (lzw::istream_source (compressed), lzw::ostream_sink (decompressed));
+    check (decompressed.str () == std::string (data.begin (), data.end ()), "iostream round trip", name, maxbits);
+
+    const std::string followed = compressed.str () + "trailer";
+    lzw::span_source left (followed);
+    lzw::decompress (left, lzw::vector_sink (output));
+    check (output == data && left.size () == 7 && !std::memcmp (left.data (), "trailer", 7), "data after the stream", name, maxbits);
+}
+
+// start streams on one object and finish them on another (moved into, or assigned to)
+
+static void move_tests (const bytes &data, const char *name, int maxbits)
+{
+    const size_t half = data.size () / 2;
+    bytes stream, output;
+
+    lzw::encoder first (maxbits);
+    first.feed (lzw::span_source (&data [0], half), lzw::vector_sink (stream));
+    lzw::encoder second (std::move (first));
+    second.feed (lzw::span_source (&data [half], data.size () - half), lzw::vector_sink (stream));
+    lzw::encoder third (9);                     // (its context is released by "second" going out of scope)
+    third = std::move (second);
+    third.finish (lzw::vector_sink (stream));
+    check (stream == c_compress (data, maxbits), "moved encoder", name, maxbits);
+
+    lzw::decoder one;
+    one.feed (lzw::span_source (&stream [0], stream.size () / 2), lzw::vector_sink (output));
+    lzw::decoder two (std::move (one));
+    lzw::decoder three;
+    three = std::move (two);
+    bool done = three.feed (lzw::span_source (&stream [stream.size () / 2], stream.size () - stream.size () / 2), lzw::vector_sink (output));
+    check (done && three.done () && output == data, "moved decoder", name, maxbits);
+}
+
+// every flush must make everything fed so far come out of the decoder, without waiting for more
+
+static void flush_tests (const bytes &data, const char *name, int maxbits)
+{
+    lzw::encoder enc (maxbits);
+    lzw::decoder dec;
+    bytes stream, output;
+    size_t index = 0, chunk = 1;
+    bool delivered = true;
+
+    enc.allow_flush ();
+
+    while (index < data.size ()) {
+        size_t count = std::min (chunk, data.size () - index), stream_start = stream.size ();
+
+        enc.feed (lzw::span_source (&data [index], count), lzw::vector_sink (stream));
+        enc.flush (lzw::vector_sink (stream));
+        index += count;
+        chunk = chunk * 3 + 7;
+
+        dec.feed (lzw::span_source (&stream [stream_start], stream.size () - stream_start), lzw::vector_sink (output));
+        delivered &= output.size () == index && std::equal (output.begin (), output.end (), data.begin ());
+    }
+
+    size_t stream_start = stream.size ();
+    enc.finish (lzw::vector_sink (stream));
+    bool done = dec.feed (lzw::span_source (&stream [stream_start], stream.size () - stream_start), lzw::vector_sink (output));
+    check (delivered && done && output == data, "flush", name, maxbits);
+
+    lzw::encoder late (maxbits);
+    late.feed (lzw::span_source (&data [0], 1), lzw::vector_sink (stream));
+    check (throws ([&] { late.allow_flush (); }), "allow_flush() after feeding", name, maxbits);
+}
+
+// a preset dictionary built from the start of the data, used on a message from later on
+
+static void dictionary_tests (const bytes &data, const char *name, int maxbits)
+{
+    const size_t content_size = std::min (data.size () / 2, static_cast<size_t> (4) << maxbits);
+    bytes message (data.end () - std::min (data.size () - content_size, static_cast<size_t> (1000)), data.end ());
+    bytes stream, output, file (LZW_DICTIONARY_HEADER_SIZE);
+    lzw::dictionary dict (&data [0], content_size, maxbits, 0x12345678);
+
+    lzw::compress (lzw::span_source (message), lzw::vector_sink (stream), dict);
+    lzw::decompress (lzw::span_source (stream), lzw::vector_sink (output), dict);
+    check (output == message, "dictionary round trip", name, maxbits);
+    check (throws ([&] { bytes out; lzw::decompress (lzw::span_source (stream), lzw::vector_sink (out)); }),
+        "dictionary stream without the dictionary", name, maxbits);
+
+    // the same content as a dictionary file (see lzwlib.h), then moved to another object
+
+    std::memcpy (&file [0], LZW_DICTIONARY_MAGIC, 4);
+    file [4] = 1;
+    file [5] = static_cast<unsigned char> (maxbits);
+
+    for (int i = 0; i < 4; ++i) {
+        file [8 + i] = static_cast<unsigned char> (0x12345678 >> (i * 8));
+        file [12 + i] = static_cast<unsigned char> (content_size >> (i * 8));
+    }
+
+    file.insert (file.end (), data.begin (), data.begin () + content_size);
+    lzw::dictionary loaded = lzw::dictionary::load (&file [0], file.size ());
+    lzw::dictionary moved (std::move (loaded));
+    output.clear ();
+    lzw::decoder dec (moved);
+    check (dec.feed (lzw::span_source (stream), lzw::vector_sink (output)) && output == message, "loaded dictionary", name, maxbits);
+
+    file [0] = 'X';
+    check (throws ([&] { lzw::dictionary::load (&file [0], file.size ()); }), "bad dictionary file", name, maxbits);
+}
+
+static void error_tests (const bytes &data, const char *name, int maxbits)
+{
+    const bytes stream = c_compress (data, maxbits);
+    bytes output;
+
+    check (throws ([&] { lzw::encoder enc (8); }), "bad maxbits", name, maxbits);
+
+    // truncated (and the decoder just waits for more), corrupt header, and output that doesn't fit
+
+    check (throws ([&] { lzw::decompress (lzw::span_source (&stream [0], stream.size () - 1), lzw::vector_sink (output)); }),
+        "truncated stream", name, maxbits);
+
+    lzw::decoder dec;
+    check (!dec.feed (lzw::span_source (&stream [0], stream.size () / 2), lzw::vector_sink (output)) && !dec.done (),
+        "partial stream", name, maxbits);
+
+    bytes corrupt (stream);
+    corrupt [0] |= 0xe0;
+    check (throws ([&] { lzw::decompress (lzw::span_source (corrupt), lzw::vector_sink (output)); }), "corrupt stream", name, maxbits);
+
+    if (!data.empty ()) {
+        bytes small (data.size ());
+        check (throws ([&] { lzw::decompress (lzw::span_source (stream), lzw::span_sink (&small [0], small.size () - 1)); }),
+            "overflowing span_sink", name, maxbits);
+    }
+}
+
+static void run_tests (const bytes &data, const char *name)
+{
+    for (int maxbits = 9; maxbits <= 16; ++maxbits) {
+        try {
+            source_sink_tests (data, name, maxbits);
+
+            if (data.size () >= 2) {
+                move_tests (data, name, maxbits);
+                flush_tests (data, name, maxbits);
+                dictionary_tests (data, name, maxbits);
+            }
+
+            error_tests (data, name, maxbits);
+        }
+        catch (const lzw::error &e) {
+            check (false, e.what (), name, maxbits);
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    run_tests (generate_data (100000, 0x1414213562373095ULL), "text");
+    run_tests (generate_data (5000, 0x1732050807568877ULL), "short text");
+    run_tests (bytes (100000, 0), "zeros");
+
+    bytes noise (100000);
+
+    for (size_t i = 0; i < noise.size (); ++i)
+        noise [i] = static_cast<unsigned char> ((i * 2654435761U) >> 13);
+
+    run_tests (noise, "noise");
+
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file (argv [i], std::ios::binary);
+        bytes data ((std::istreambuf_iterator<char> (file)), std::istreambuf_iterator<char> ());
+
+        if (!file && !file.eof ()) {
+            std::printf ("file %s could not be read!\n", argv [i]);
+            errors++;
+        }
+        else
+            run_tests (data, argv [i]);
+    }
+
+    if (errors)
+        std::printf ("\n***** %d errors detected in %d tests *****\n\n", errors, tests);
+    else
+        std::printf ("successfully ran %d tests with no errors detected\n", tests);
+
+    return errors ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 //      Distributed under the BSD Software License (see license.txt)      //
 ////////////////////////////////////////////////////////////////////////////
 
+#define _FILE_OFFSET_BITS 64    // for random access to large files
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,22 +14,65 @@
 
 #ifdef _WIN32
 #include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MAPPED_INPUT    // regular files on stdin are memory-mapped
 #endif
 
 #include "lzwlib.h"
+#include "lzwframe.h"
+#include "lzwthread.h"
 
 /* This module provides a command-line filter for testing the lzw library.
  * It can also optionally calculate and display the compression ratio and
- * a simple checksum for informational purposes. Other command-line
+ * the CRC32C of the uncompressed data (which is calculated a buffer at a
+ * time, so it's essentially free). Other command-line
  * arguments select decoding mode or the maximum symbol size (9 to 16 bits)
- * for encoding.
+ * for encoding, and the framed (multithreaded) mode. Framed data is detected
+ * automatically when decompressing, and a range of an indexed frame can be
+ * extracted directly if the input is a file (i.e., not a pipe). The test
+ * mode (-t) decodes without writing anything, and if the frame has checksums
+ * (-C) they are all verified (which is also done on regular decompression).
+ * With -X, blocks of already compressed data are stored instead of inflated.
+ *
+ * A preset dictionary (from lzwtrain) can be specified for the non-framed
+ * mode, which helps a lot with short inputs.
+ *
+ * When stdin is a regular file (and not on Windows) it's memory-mapped instead
+ * of read. Then the non-framed modes use the streaming functions to work right
+ * out of the mapping into a large output buffer, and the framed modes copy the
+ * blocks straight from the mapping. Pipes still go through the 64 KB buffers.
+ *
+ * With -p the reading of stdin and the writing of stdout are each done on their
+ * own thread (through a few large buffers) so that they overlap with the work.
+ *
+ * With -a the maximum symbol size is chosen by trial compression of the first
+ * megabyte (see lzw_select_maxbits()), with -1 to -8 as the upper limit.
+ *
+ * For long non-framed streams, decompressing with -K writes a file of decoder
+ * checkpoints (one every 16 MB of output, or -I<n> MB), and then -R with the same
+ * -K file starts from the last checkpoint before the range instead of the start.
  */
 
 static const char *usage =
 " Usage:     lzwfilter [-options] [< infile] [> outfile]\n\n"
 " Operation: compression is default, use -d to decompress\n\n"
 " Options:  -d     = decompress\n"
+"           -t     = test (decompress and verify, but discard output)\n"
 "           -h     = display this \"help\" message\n"
+"           -B<n>  = framed mode with block size = n KB (default 1024)\n"
+"           -T<n>  = framed mode with n threads (also for decompress)\n"
+"           -S     = framed mode with index for random access\n"
+"           -C     = framed mode with CRC32C checksums\n"
+"           -X     = framed mode storing blocks that don't compress\n"
+"           -P<f>  = use preset dictionary file f (made by lzwtrain)\n"
+"           -p     = pipelined I/O (read and write on separate threads)\n"
+"           -R<o>  = decompress from offset o of indexed frame (which\n"
+"                    must be a file), use -R<o>,<n> for only n bytes\n"
+"           -K<f>  = checkpoint file f for non-framed streams (written\n"
+"                    with -d or -t, and used by -R for a quick start)\n"
+"           -I<n>  = checkpoint interval = n MB of output (default 16)\n"
 "           -1     = maximum symbol size = 9 bits\n"
 "           -2     = maximum symbol size = 10 bits\n"
 "           -3     = maximum symbol size = 11 bits\n"
@@ -37,32 +81,452 @@ static const char *usage =
 "           -6     = maximum symbol size = 14 bits\n"
 "           -7     = maximum symbol size = 15 bits\n"
 "           -8     = maximum symbol size = 16 bits (default)\n"
-"           -v     = verbose (display ratio and checksum)\n\n"
+"           -a<n>  = automatic maximum symbol size (up to the above), the\n"
+"                    smallest within n% of the best ratio (default 1%)\n"
+"           -v     = verbose (display ratio and CRC32C)\n\n"
 " Web:       Visit www.github.com/dbry/lzw-ab for latest version and info\n\n";
 
+/* A pipe passes buffers between the main thread and an I/O thread (reading stdin or writing stdout).
+ * Buffers are "produced" (filled) on one side and "consumed" on the other, in order; "produced" and
+ * "consumed" count them, so buffer "produced % PIPE_BUFFERS" is the one being filled (if there's room)
+ * and "consumed % PIPE_BUFFERS" is the one being emptied (if there are any). Either side can quit
+ * early: "finished" is set by the producer after its last buffer and "aborted" by the consumer, and
+ * a write error sets "error" (but the writer keeps consuming so that the main thread can't stall).
+ */
+
+#define PIPE_BUFFERS        3
+#define PIPE_BUFFER_SIZE    (1024 * 1024)
+
 typedef struct {
-    unsigned char buffer [65536];
-    int checksum, head, tail;
-    size_t byte_count;
+    unsigned char *buffers [PIPE_BUFFERS];
+    size_t counts [PIPE_BUFFERS];
+    unsigned int produced, consumed;
+    int finished, aborted, error;
+    lzw_monitor_t monitor;
+    lzw_thread_t thread;
+} pipe_t;
+
+// wait for an empty buffer to fill (NULL if the consumer quit)
+
+static unsigned char *pipe_produce (pipe_t *pipe)
+{
+    unsigned char *buffer = NULL;
+
+    lzw_monitor_lock (&pipe->monitor);
+
+    while (pipe->produced - pipe->consumed == PIPE_BUFFERS && !pipe->aborted)
+        lzw_monitor_wait (&pipe->monitor);
+
+    if (!pipe->aborted)
+        buffer = pipe->buffers [pipe->produced % PIPE_BUFFERS];
+
+    lzw_monitor_unlock (&pipe->monitor);
+    return buffer;
+}
+
+// pass on the buffer just filled (with "count" bytes), or finish if "count" is zero
+
+static void pipe_commit (pipe_t *pipe, size_t count)
+{
+    lzw_monitor_lock (&pipe->monitor);
+
+    if (count)
+        pipe->counts [pipe->produced++ % PIPE_BUFFERS] = count;
+    else
+        pipe->finished = 1;
+
+    lzw_monitor_notify (&pipe->monitor);
+    lzw_monitor_unlock (&pipe->monitor);
+}
+
+// wait for a full buffer to empty (NULL if the producer finished)
+
+static unsigned char *pipe_consume (pipe_t *pipe, size_t *count)
+{
+    unsigned char *buffer = NULL;
+
+    lzw_monitor_lock (&pipe->monitor);
+
+    while (pipe->produced == pipe->consumed && !pipe->finished)
+        lzw_monitor_wait (&pipe->monitor);
+
+    if (pipe->produced != pipe->consumed) {
+        buffer = pipe->buffers [pipe->consumed % PIPE_BUFFERS];
+        *count = pipe->counts [pipe->consumed % PIPE_BUFFERS];
+    }
+
+    lzw_monitor_unlock (&pipe->monitor);
+    return buffer;
+}
+
+// hand back the buffer just emptied, or quit if "abort" is set
+
+static void pipe_release (pipe_t *pipe, int abort)
+{
+    lzw_monitor_lock (&pipe->monitor);
+
+    if (abort)
+        pipe->aborted = 1;
+    else
+        pipe->consumed++;
+
+    lzw_monitor_notify (&pipe->monitor);
+    lzw_monitor_unlock (&pipe->monitor);
+}
+
+static void reader_thread (void *ctx)
+{
+    pipe_t *pipe = ctx;
+    unsigned char *buffer;
+
+    while ((buffer = pipe_produce (pipe))) {
+        size_t count = fread (buffer, 1, PIPE_BUFFER_SIZE, stdin);
+
+        if (count)
+            pipe_commit (pipe, count);
+
+        if (count < PIPE_BUFFER_SIZE)
+            break;
+    }
+
+    pipe_commit (pipe, 0);
+}
+
+static void writer_thread (void *ctx)
+{
+    pipe_t *pipe = ctx;
+    unsigned char *buffer;
+    size_t count;
+
+    while ((buffer = pipe_consume (pipe, &count))) {
+        if (!pipe->error && fwrite (buffer, 1, count, stdout) != count)
+            pipe->error = 1;
+
+        pipe_release (pipe, 0);
+    }
+
+    if (fflush (stdout))
+        pipe->error = 1;
+}
+
+// allocate a pipe and start its thread, returns NULL on any failure (then the I/O is just done directly)
+
+static pipe_t *pipe_open (void (*function)(void *))
+{
+    pipe_t *pipe = calloc (1, sizeof (pipe_t));
+    int i;
+
+    if (!pipe)
+        return NULL;
+
+    for (i = 0; i < PIPE_BUFFERS; ++i)
+        if (!(pipe->buffers [i] = malloc (PIPE_BUFFER_SIZE)))
+            break;
+
+    if (i == PIPE_BUFFERS && !lzw_monitor_init (&pipe->monitor)) {
+        if (!lzw_thread_create (&pipe->thread, function, pipe))
+            return pipe;
+
+        lzw_monitor_free (&pipe->monitor);
+    }
+
+    while (i--)
+        free (pipe->buffers [i]);
+
+    free (pipe);
+    return NULL;
+}
+
+/* The buffered I/O for stdin and stdout. The checksum and byte count are not updated per byte, but
+ * instead a buffer at a time: the bytes from "summed" to "head" have been consumed (or written)
+ * but not yet included. When decompressing, only the bytes actually used are counted (because the
+ * decoder stops at the end of the stream, whatever follows in the buffer doesn't count). With a
+ * pipe, "buffer" is the one currently held from it ("held" is set, and "size" is its size) rather
+ * than the local one. For sampling the input it can also be a larger "allocated" one.
+ */
+
+typedef struct {
+    unsigned char *buffer, *allocated, local [65536];
+    size_t head, tail, summed, size;
+    int discard, held;
+    unsigned int checksum;
+    unsigned long long byte_count;      // (64-bit even where size_t isn't, for streams over 4 GB)
+    const unsigned char *mapped;        // memory-mapped input (if not NULL), with its size and position
+    size_t mapped_size, mapped_index;
+    pipe_t *pipe;
 } streamer;
 
+static void init_streamer (streamer *stream)
+{
+    memset (stream, 0, sizeof (*stream));
+    stream->buffer = stream->local;
+    stream->size = sizeof (stream->local);
+}
+
+static void update_checksum (streamer *stream)
+{
+    stream->checksum = lzw_crc32c (stream->checksum, stream->buffer + stream->summed, stream->head - stream->summed);
+    stream->byte_count += stream->head - stream->summed;
+    stream->summed = stream->head;
+}
+
+static void fill_buffer (streamer *stream)
+{
+    update_checksum (stream);
+    stream->head = stream->summed = 0;
+
+    if (stream->pipe) {
+        unsigned char *buffer;
+        size_t count;
+
+        if (stream->held)
+            pipe_release (stream->pipe, 0);
+
+        if ((stream->held = (buffer = pipe_consume (stream->pipe, &count)) != NULL)) {
+            stream->buffer = buffer;
+            stream->tail = count;
+        }
+        else
+            stream->tail = 0;
+    }
+    else
+        stream->tail = fread (stream->buffer, 1, stream->size, stdin);
+}
+
+static void flush_buffer (streamer *stream)
+{
+    update_checksum (stream);
+
+    if (stream->pipe) {
+        if (stream->head) {
+            pipe_commit (stream->pipe, stream->head);
+            stream->buffer = pipe_produce (stream->pipe);   // (never NULL because the writer doesn't abort)
+        }
+    }
+    else if (!stream->discard)
+        fwrite (stream->buffer, 1, stream->head, stdout);
+
+    stream->head = stream->summed = 0;
+}
+
+/* Start pipelined I/O on a streamer (which must be empty). If this fails (which is unlikely) the streamer
+ * just continues to do its own I/O. The writer's thread is joined by stop_pipelining() to make sure that
+ * everything is written, but the reader's isn't (it's told to quit, but might be blocked reading a pipe
+ * that's still open after the end of the stream, and exiting takes care of it).
+ */
+
+static void start_pipelining (streamer *stream, int writer)
+{
+    if (!(stream->pipe = pipe_open (writer ? writer_thread : reader_thread)))
+        return;
+
+    if (writer) {
+        stream->buffer = pipe_produce (stream->pipe);
+        stream->size = PIPE_BUFFER_SIZE;
+    }
+}
+
+/* Get a sample of the input (up to LZW_SELECT_SAMPLE bytes) without consuming it, which must be done before
+ * anything is read. Unless the input is mapped, this is the first buffer, which is made large enough
+ * (the pipe's already are). The sample may be shorter on error.
+ */
+
+static const unsigned char *sample_input (streamer *stream, size_t *sample_size)
+{
+    if (stream->mapped) {
+        *sample_size = stream->mapped_size < LZW_SELECT_SAMPLE ? stream->mapped_size : LZW_SELECT_SAMPLE;
+        return stream->mapped;
+    }
+
+    if (!stream->pipe && (stream->allocated = malloc (LZW_SELECT_SAMPLE))) {
+        stream->buffer = stream->allocated;
+        stream->size = LZW_SELECT_SAMPLE;
+    }
+
+    fill_buffer (stream);
+    *sample_size = stream->tail;
+    return stream->buffer;
+}
+
+// returns non-zero if there was a write error
+
+static int stop_pipelining (streamer *stream, int writer)
+{
+    pipe_t *pipe = stream->pipe;
+    int error = 0, i;
+
+    if (!pipe)
+        return 0;
+
+    if (writer) {
+        flush_buffer (stream);
+        pipe_commit (pipe, 0);
+        lzw_thread_join (&pipe->thread);
+        lzw_monitor_free (&pipe->monitor);
+        error = pipe->error;
+
+        for (i = 0; i < PIPE_BUFFERS; ++i)
+            free (pipe->buffers [i]);
+
+        free (pipe);
+    }
+    else
+        pipe_release (pipe, 1);
+
+    stream->buffer = stream->local;
+    stream->size = sizeof (stream->local);
+    stream->head = stream->tail = stream->summed = stream->held = 0;
+    stream->pipe = NULL;
+    return error;
+}
+
 static int read_buff (void *ctx)
 {
     streamer *stream = ctx;
-    int value;
 
     if (stream->head == stream->tail)
-        stream->tail = (stream->head = 0) + fread (stream->buffer, 1, sizeof (stream->buffer), stdin);
+        fill_buffer (stream);
+
+    return stream->head < stream->tail ? stream->buffer [stream->head++] : EOF;
+}
+
+// block versions of the above for the framed mode (these go through the same buffers)
 
-    if (stream->head < stream->tail) {
-        value = stream->buffer [stream->head++];
-        stream->checksum = stream->checksum * 3 + (unsigned char) value;
-        stream->byte_count++;
+static size_t read_block (void *buffer, size_t size, void *ctx)
+{
+    unsigned char *dst = buffer;
+    streamer *stream = ctx;
+    size_t count = 0;
+
+    if (stream->mapped) {
+        if (size > stream->mapped_size - stream->mapped_index)
+            size = stream->mapped_size - stream->mapped_index;
+
+        memcpy (dst, stream->mapped + stream->mapped_index, size);
+        stream->checksum = lzw_crc32c (stream->checksum, dst, size);
+        stream->byte_count += size;
+        stream->mapped_index += size;
+        return size;
+    }
+
+    while (count < size) {
+        size_t bytes;
+
+        if (stream->head == stream->tail)
+            fill_buffer (stream);
+
+        if (!(bytes = stream->tail - stream->head))
+            break;
+
+        if (bytes > size - count)
+            bytes = size - count;
+
+        memcpy (dst + count, stream->buffer + stream->head, bytes);
+        stream->head += bytes;
+        count += bytes;
+    }
+
+    return count;
+}
+
+static int write_block (const void *buffer, size_t size, void *ctx)
+{
+    const unsigned char *src = buffer;
+    streamer *stream = ctx;
+
+    if (stream->pipe) {                 // copy into the pipe's buffers (checksummed as they're flushed, and errors
+                                        // are returned by stop_pipelining())
+        while (size) {
+            size_t bytes = size < stream->size - stream->head ? size : stream->size - stream->head;
+
+            memcpy (stream->buffer + stream->head, src, bytes);
+            stream->head += bytes;
+            src += bytes;
+            size -= bytes;
+
+            if (stream->head == stream->size)
+                flush_buffer (stream);
+        }
+
+        return 0;
     }
-    else
-        value = EOF;
 
-    return value;
+    if (stream->head)
+        flush_buffer (stream);
+
+    stream->checksum = lzw_crc32c (stream->checksum, buffer, size);
+    stream->byte_count += size;
+    return !stream->discard && fwrite (buffer, 1, size, stdout) != size;
+}
+
+// random access read of stdin for lzw_read_at() (so stdin must be a file)
+
+// seek to a 64-bit "position" in a file, returns non-zero on error
+
+static int seek_file (FILE *file, unsigned long long position)
+{
+#ifdef _WIN32
+    return _fseeki64 (file, position, SEEK_SET);
+#else
+    return fseeko (file, position, SEEK_SET);
+#endif
+}
+
+static size_t read_stdin_at (void *buffer, size_t size, unsigned long long position, void *ctx)
+{
+    streamer *stream = ctx;
+
+    if (stream->mapped) {
+        if (position >= stream->mapped_size)
+            return 0;
+
+        if (size > stream->mapped_size - position)
+            size = (size_t) (stream->mapped_size - position);
+
+        memcpy (buffer, stream->mapped + position, size);
+        return size;
+    }
+
+    if (seek_file (stdin, position))
+        return 0;
+
+    return fread (buffer, 1, size, stdin);
+}
+
+// extract "length" bytes at "offset" from the indexed frame on stdin, returns non-zero on error
+
+static int read_range (streamer *source, streamer *writer, unsigned long long offset, unsigned long long length)
+{
+    unsigned long long frame_size;
+    lzw_reader_t *reader;
+    int error = 0;
+
+    if (source->mapped)
+        frame_size = source->mapped_size;
+#ifdef _WIN32
+    else if (_fseeki64 (stdin, 0, SEEK_END) || (frame_size = _ftelli64 (stdin)) == (unsigned long long) -1)
+#else
+    else if (fseeko (stdin, 0, SEEK_END) || (frame_size = ftello (stdin)) == (unsigned long long) -1)
+#endif
+        return 1;
+
+    if (!(reader = lzw_reader_open (read_stdin_at, source, frame_size)))
+        return 1;
+
+    while (length && !error) {
+        size_t count = length < sizeof (writer->local) ? (size_t) length : sizeof (writer->local);
+
+        error = lzw_read_at (reader, offset, writer->local, &count) || write_block (writer->local, count, writer);
+
+        if (!count)
+            break;
+
+        length -= count;
+        offset += count;
+    }
+
+    lzw_reader_close (reader);
+    return error;
 }
 
 static void write_buff (int value, void *ctx)
@@ -70,29 +534,344 @@ static void write_buff (int value, void *ctx)
     streamer *stream = ctx;
 
     if (value == EOF) {
-        fwrite (stream->buffer, 1, stream->head, stdout);
+        flush_buffer (stream);
         return;
     }
 
     stream->buffer [stream->head++] = value;
 
-    if (stream->head == sizeof (stream->buffer)) {
-        fwrite (stream->buffer, 1, stream->head, stdout);
-        stream->head = 0;
+    if (stream->head == stream->size)
+        flush_buffer (stream);
+}
+
+#ifdef MAPPED_INPUT
+
+// memory-map stdin if it's a (non-empty) regular file, returns non-zero on success
+
+static int map_stdin (streamer *stream)
+{
+    struct stat statbuf;
+    void *mapped;
+
+    if (fstat (fileno (stdin), &statbuf) || !S_ISREG (statbuf.st_mode) || statbuf.st_size <= 0 ||
+        (unsigned long long) statbuf.st_size > (size_t) -1)
+            return 0;
+
+    mapped = mmap (NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE, fileno (stdin), 0);
+
+    if (mapped == MAP_FAILED)
+        return 0;
+
+    madvise (mapped, (size_t) statbuf.st_size, MADV_SEQUENTIAL);
+    stream->mapped = mapped;
+    stream->mapped_size = (size_t) statbuf.st_size;
+    return 1;
+}
+
+static void unmap_stdin (streamer *stream)
+{
+    if (stream->mapped)
+        munmap ((void *) stream->mapped, stream->mapped_size);
+
+    stream->mapped = NULL;
+}
+
+#endif
+
+#define STREAM_CHUNK    (1024 * 1024)   // mapped input consumed (and checksummed) per call of the streaming functions
+#define STREAM_OUTPUT   (1024 * 1024)   // output buffer used with the streaming functions
+
+/* Compress or decompress with the streaming functions, which is done for mapped input (so that it works
+ * directly from the mapping), with preset dictionaries (which the callback functions don't take) and when
+ * writing decoder checkpoints (to the "checkpoints" file, whenever another "interval" bytes have been
+ * output). Only the output is buffered, STREAM_OUTPUT bytes at a time. The checksum and byte count of the
+ * input include only the bytes that were consumed. Returns non-zero on error.
+ */
+
+#ifdef LZW_STATS
+static int process_stream (streamer *reader, streamer *writer, int decompress, int maxbits, const lzw_dictionary_t *dictionary,
+    FILE *checkpoints, unsigned long long interval, lzw_stats_t *stats, lzw_event_fn event)
+#else
+static int process_stream (streamer *reader, streamer *writer, int decompress, int maxbits, const lzw_dictionary_t *dictionary,
+    FILE *checkpoints, unsigned long long interval)
+#endif
+{
+    unsigned long long input_offset = 0, output_offset = 0, next_checkpoint = interval;
+    unsigned char *output = malloc (STREAM_OUTPUT), *checkpoint = NULL;
+    int res, draining = 0;
+    lzw_encoder_t enc;
+    lzw_decoder_t dec;
+
+    if (decompress && checkpoints && output && !(checkpoint = malloc (lzw_checkpoint_bound (16)))) {
+        free (output);
+        return 1;
+    }
+
+    if (!output)
+        return 1;
+
+    if (decompress)
+        res = dictionary ? lzw_decoder_init_dict (&dec, dictionary) : lzw_decoder_init (&dec);
+    else
+        res = dictionary ? lzw_encoder_init_dict (&enc, dictionary) : lzw_encoder_init (&enc, maxbits);
+
+    if (res) {
+        free (checkpoint);
+        free (output);
+        return 1;
+    }
+
+#ifdef LZW_STATS
+    if (stats) {
+        if (decompress)
+            lzw_decoder_stats (&dec, stats, event, NULL);
+        else
+            lzw_encoder_stats (&enc, stats, event, NULL);
+    }
+#endif
+
+    while (1) {
+        size_t in_bytes, out_bytes = STREAM_OUTPUT;
+        const unsigned char *in;
+
+        if (reader->mapped) {
+            in = reader->mapped + reader->mapped_index;
+            in_bytes = reader->mapped_size - reader->mapped_index;
+
+            if (in_bytes > STREAM_CHUNK)
+                in_bytes = STREAM_CHUNK;
+        }
+        else {
+            if (reader->head == reader->tail)
+                fill_buffer (reader);
+
+            in = reader->buffer + reader->head;
+            in_bytes = reader->tail - reader->head;
+        }
+
+        if (draining)       // a checkpoint is due, so first send the rest of the current string
+            in_bytes = 0;
+
+        if (decompress)
+            res = lzw_decoder_feed (&dec, in, &in_bytes, output, &out_bytes);
+        else if (!in_bytes)
+            res = lzw_encoder_finish (&enc, output, &out_bytes);
+        else
+            res = lzw_encoder_feed (&enc, in, &in_bytes, output, &out_bytes);
+
+        if (res == LZW_ERROR)
+            break;
+
+        if (reader->mapped) {
+            reader->checksum = lzw_crc32c (reader->checksum, in, in_bytes);
+            reader->byte_count += in_bytes;
+            reader->mapped_index += in_bytes;
+        }
+        else
+            reader->head += in_bytes;
+
+        if (out_bytes && write_block (output, out_bytes, writer)) {
+            res = LZW_ERROR;
+            break;
+        }
+
+        input_offset += in_bytes;
+        output_offset += out_bytes;
+
+        if (checkpoint && res == LZW_OK && output_offset >= next_checkpoint) {
+            size_t checkpoint_size = lzw_checkpoint_bound (16);
+
+            if (!(draining = lzw_decoder_checkpoint (&dec, input_offset, output_offset, checkpoint, &checkpoint_size))) {
+                if (fwrite (checkpoint, 1, checkpoint_size, checkpoints) != checkpoint_size) {
+                    res = LZW_ERROR;
+                    break;
+                }
+
+                next_checkpoint = output_offset + interval;
+            }
+        }
+
+        if (res == LZW_DONE || (decompress && !in_bytes && !out_bytes))
+            break;      // (no progress decoding is a truncated stream)
     }
 
-    stream->checksum = stream->checksum * 3 + (unsigned char) value;
-    stream->byte_count++;
+    if (!decompress)
+        lzw_encoder_free (&enc);
+    else if (lzw_decoder_finish (&dec))
+        res = LZW_ERROR;
+
+    free (checkpoint);
+    free (output);
+    return res != LZW_DONE;
 }
 
+#ifdef LZW_STATS
+#define PROCESS_STREAM(decompress) process_stream (&reader, &writer, decompress, maxbits, dictionary, \
+    checkpoints, checkpoint_interval, &stats, verbose > 1 ? display_event : NULL)
+#else
+#define PROCESS_STREAM(decompress) process_stream (&reader, &writer, decompress, maxbits, dictionary, checkpoints, checkpoint_interval)
+#endif
+
+/* Extract "length" bytes at "offset" from the non-framed stream on stdin, starting from the last checkpoint
+ * at or before the offset in the "checkpoints" file (written by -K when decompressing), or from the start of
+ * the stream if there isn't one. Only the input after the checkpoint is read, and the output before the
+ * offset is discarded. Returns non-zero on error.
+ */
+
+static int read_checkpointed_range (streamer *source, streamer *writer, FILE *checkpoints, const lzw_dictionary_t *dictionary,
+    unsigned long long offset, unsigned long long length)
+{
+    unsigned long long input_offset = 0, output_offset = 0, position = 0, best_position = 0, checkpoint_input, checkpoint_output;
+    unsigned char header [LZW_CHECKPOINT_HEADER_SIZE], *checkpoint = NULL, *output;
+    size_t checkpoint_size, best_size = 0, in_index = 0, in_count = 0;
+    lzw_decoder_t dec;
+    int res;
+
+    // find the last checkpoint before the offset (they're in order, but we don't depend on that)
+
+    while (fread (header, 1, sizeof (header), checkpoints) == sizeof (header)) {
+        if (!(checkpoint_size = lzw_checkpoint_info (header, &checkpoint_input, &checkpoint_output)))
+            return 1;
+
+        if (checkpoint_output <= offset && (!best_size || checkpoint_output > output_offset)) {
+            input_offset = checkpoint_input;
+            output_offset = checkpoint_output;
+            best_position = position;
+            best_size = checkpoint_size;
+        }
+
+        if (seek_file (checkpoints, position += checkpoint_size))
+            return 1;
+    }
+
+    if (!(output = malloc (STREAM_OUTPUT)))
+        return 1;
+
+    res = dictionary ? lzw_decoder_init_dict (&dec, dictionary) : lzw_decoder_init (&dec);
+
+    if (!res && best_size) {
+        if (!(checkpoint = malloc (best_size)) || seek_file (checkpoints, best_position) ||
+            fread (checkpoint, 1, best_size, checkpoints) != best_size || lzw_decoder_restore (&dec, checkpoint, best_size))
+                res = LZW_ERROR;
+
+        free (checkpoint);
+    }
+
+    while (!res && length) {
+        size_t in_bytes, out_bytes = STREAM_OUTPUT, skip_bytes;
+        const unsigned char *in;
+
+        if (source->mapped) {
+            in = source->mapped + (input_offset < source->mapped_size ? input_offset : source->mapped_size);
+            in_bytes = input_offset < source->mapped_size ? source->mapped_size - input_offset : 0;
+
+            if (in_bytes > STREAM_CHUNK)
+                in_bytes = STREAM_CHUNK;
+        }
+        else {
+            if (in_index == in_count) {
+                in_count = read_stdin_at (source->local, sizeof (source->local), input_offset, source);
+                in_index = 0;
+            }
+
+            in = source->local + in_index;
+            in_bytes = in_count - in_index;
+        }
+
+        res = lzw_decoder_feed (&dec, in, &in_bytes, output, &out_bytes);
+
+        if (res == LZW_ERROR || (!in_bytes && !out_bytes))
+            break;      // (no progress is a truncated stream)
+
+        input_offset += in_bytes;
+        in_index += in_bytes;
+        skip_bytes = output_offset < offset ? (offset - output_offset < out_bytes ? (size_t) (offset - output_offset) : out_bytes) : 0;
+        output_offset += out_bytes;
+        out_bytes -= skip_bytes;
+
+        if (out_bytes > length)
+            out_bytes = (size_t) length;
+
+        if (out_bytes && write_block (output + skip_bytes, out_bytes, writer)) {
+            res = LZW_ERROR;
+            break;
+        }
+
+        length -= out_bytes;
+    }
+
+    lzw_decoder_finish (&dec);
+    free (output);
+    return res == LZW_ERROR || (res == LZW_OK && length);
+}
+
+// read a preset dictionary file (see lzwlib.h), returns NULL on any error
+
+static lzw_dictionary_t *load_dictionary (const char *filename)
+{
+    lzw_dictionary_t *dictionary = NULL;
+    FILE *file = fopen (filename, "rb");
+    unsigned char *file_data;
+    long file_size;
+
+    if (!file)
+        return NULL;
+
+    if (!fseek (file, 0, SEEK_END) && (file_size = ftell (file)) > 0 && !fseek (file, 0, SEEK_SET) &&
+        (file_data = malloc (file_size))) {
+            if (fread (file_data, 1, file_size, file) == (size_t) file_size)
+                dictionary = lzw_dictionary_load (file_data, file_size);
+
+            free (file_data);
+    }
+
+    fclose (file);
+    return dictionary;
+}
+
+#ifdef LZW_STATS
+
+// when built with LZW_STATS, verbose mode also displays the statistics (for the non-framed modes)
+
+static void display_stats (const lzw_stats_t *stats)
+{
+    fprintf (stderr, "codes = %llu (%.2f bits each), resets = %llu (ratio %llu, floor %llu), dictionary fills = %llu\n",
+        stats->codes, stats->codes ? (double) stats->code_bits / stats->codes : 0.0,
+        stats->clear_codes, stats->ratio_resets, stats->floor_resets, stats->dictionary_fulls);
+    fprintf (stderr, "lookups = %llu (average %.2f steps, max %u), recycles = %llu (average %.2f steps, max %u)\n",
+        stats->lookups, stats->lookups ? (double) stats->lookup_steps / stats->lookups : 0.0, stats->max_lookup_steps,
+        stats->recycles, stats->recycles ? (double) stats->recycle_steps / stats->recycles : 0.0, stats->max_recycle_steps);
+}
+
+static void display_event (int event, const lzw_stats_t *stats, void *ctx)
+{
+    static const char *names [] = { "", "ratio reset", "floor reset", "clear code", "dictionary full" };
+
+    fprintf (stderr, "%s at %llu bytes in, %llu bytes out\n", names [event], stats->input_bytes, stats->output_bytes);
+    (void) ctx;
+}
+
+#endif
+
 int main (int argc, char **argv)
 {
-    int decompress = 0, maxbits = 16, verbose = 0, error = 0;
+    int decompress = 0, maxbits = 16, verbose = 0, error = 0, framed = 0, threads = 1, flags = 0, range = 0, pipelined = 0;
+    int select_maxbits = 0, tolerance = 1;
+    unsigned long long range_offset = 0, range_length = (unsigned long long) -1, checkpoint_interval = 16 << 20;
+    long block_size = LZW_FRAME_BLOCK_SIZE;
+    lzw_dictionary_t *dictionary = NULL;
+    const char *checkpoint_name = NULL;
+    FILE *checkpoints = NULL;
     streamer reader, writer;
+    char *end;
+#ifdef LZW_STATS
+    lzw_stats_t stats;
+
+    memset (&stats, 0, sizeof (stats));
+#endif
 
-    memset (&reader, 0, sizeof (reader));
-    memset (&writer, 0, sizeof (writer));
-    reader.checksum = writer.checksum = -1;
+    init_streamer (&reader);
+    init_streamer (&writer);
 
     while (--argc) {
         if ((**++argv == '-') && (*argv)[1])
@@ -130,17 +909,122 @@ int main (int argc, char **argv)
                         maxbits = 16;
                         break;
 
+                    case 'a':
+                        select_maxbits = 1;
+
+                        if ((*argv) [1] >= '0' && (*argv) [1] <= '9') {
+                            tolerance = strtol (*argv + 1, &end, 10);
+                            *argv = end - 1;
+                        }
+
+                        break;
+
                     case 'D': case 'd':
                         decompress = 1;
                         break;
 
+                    case 't':
+                        writer.discard = 1;
+                        decompress = 1;
+                        break;
+
+                    case 'C':
+                        flags |= LZW_FRAME_CHECKSUM;
+                        framed = 1;
+                        break;
+
+                    case 'X':
+                        flags |= LZW_FRAME_STORED;
+                        framed = 1;
+                        break;
+
+                    case 'B':
+                        block_size = strtol (*argv + 1, &end, 10) * 1024;
+
+                        if (end == *argv + 1 || block_size < 1 || block_size > LZW_FRAME_MAX_BLOCK) {
+                            fprintf (stderr, "invalid block size!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        framed = 1;
+                        break;
+
+                    case 'P':
+                        if (dictionary)
+                            lzw_dictionary_free (dictionary);
+
+                        if (!(dictionary = load_dictionary (*argv + 1))) {
+                            fprintf (stderr, "can't load dictionary %s!\n", *argv + 1);
+                            error = 1;
+                        }
+
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'p':
+                        pipelined = 1;
+                        break;
+
+                    case 'K':
+                        if (!(*argv) [1]) {
+                            fprintf (stderr, "missing checkpoint file name!\n");
+                            error = 1;
+                        }
+
+                        checkpoint_name = *argv + 1;
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'I':
+                        checkpoint_interval = strtoull (*argv + 1, &end, 10) << 20;
+
+                        if (end == *argv + 1 || !checkpoint_interval) {
+                            fprintf (stderr, "invalid checkpoint interval!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        break;
+
+                    case 'S':
+                        flags |= LZW_FRAME_INDEX;
+                        framed = 1;
+                        break;
+
+                    case 'R':
+                        range_offset = strtoull (*argv + 1, &end, 10);
+
+                        if (end == *argv + 1) {
+                            fprintf (stderr, "invalid range!\n");
+                            error = 1;
+                        }
+                        else if (*end == ',')
+                            range_length = strtoull (end + 1, &end, 10);
+
+                        *argv = end - 1;
+                        range = 1;
+                        break;
+
+                    case 'T':
+                        threads = strtol (*argv + 1, &end, 10);
+
+                        if (end == *argv + 1 || threads < 1 || threads > LZW_FRAME_MAX_THREADS) {
+                            fprintf (stderr, "invalid thread count!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        framed = 1;
+                        break;
+
                     case 'H': case 'h':
                         fprintf (stderr, "%s", usage);
                         return 0;
                         break;
 
                     case 'V': case 'v':
-                        verbose = 1;
+                        verbose++;
                         break;
 
                     default:
@@ -154,6 +1038,31 @@ int main (int argc, char **argv)
         }
     }
 
+    if (!error && dictionary && framed) {
+        fprintf (stderr, "preset dictionaries can't be used with framed mode!\n");
+        error = 1;
+    }
+
+    if (!error && dictionary && range && !checkpoint_name) {
+        fprintf (stderr, "-R with a preset dictionary needs a checkpoint file (-K)!\n");
+        error = 1;
+    }
+
+    if (!error && dictionary && select_maxbits) {
+        fprintf (stderr, "preset dictionaries have their own maximum symbol size!\n");
+        error = 1;
+    }
+
+    if (!error && checkpoint_name && (framed || (!decompress && !range))) {
+        fprintf (stderr, "checkpoints are only for decompressing non-framed streams!\n");
+        error = 1;
+    }
+
+    if (!error && checkpoint_name && !(checkpoints = fopen (checkpoint_name, range ? "rb" : "wb"))) {
+        fprintf (stderr, "can't open checkpoint file %s!\n", checkpoint_name);
+        error = 1;
+    }
+
     if (error) {
         fprintf (stderr, "%s", usage);
         return 0;
@@ -162,30 +1071,133 @@ int main (int argc, char **argv)
 #ifdef _WIN32
     setmode (fileno (stdin), O_BINARY);
     setmode (fileno (stdout), O_BINARY);
+#else
+    map_stdin (&reader);
 #endif
 
-    if (decompress) {
-        if (lzw_decompress (write_buff, &writer, read_buff, &reader)) {
+    if (pipelined) {
+        if (!reader.mapped && !range)
+            start_pipelining (&reader, 0);
+
+        if (!writer.discard)
+            start_pipelining (&writer, 1);
+    }
+
+    if (select_maxbits && !decompress && !range) {
+        size_t sample_size;
+        const unsigned char *sample = sample_input (&reader, &sample_size);
+
+        if ((maxbits = lzw_select_maxbits (sample, sample_size, maxbits, tolerance * 10, 8)) < 0) {
+            fprintf (stderr, "lzw_select_maxbits() returned error!\n");
+            return 1;
+        }
+
+        if (verbose)
+            fprintf (stderr, "selected maximum symbol size = %d bits\n", maxbits);
+    }
+
+    if (range && checkpoints) {
+        if (read_checkpointed_range (&reader, &writer, checkpoints, dictionary, range_offset, range_length)) {
+            fprintf (stderr, "can't read range using checkpoints!\n");
+            return 1;
+        }
+
+        if (verbose)
+            fprintf (stderr, "output CRC32C = %08x\n", writer.checksum);
+    }
+    else if (range) {
+        if (read_range (&reader, &writer, range_offset, range_length)) {
+            fprintf (stderr, "can't read range from indexed frame!\n");
+            return 1;
+        }
+
+        if (verbose)
+            fprintf (stderr, "output CRC32C = %08x\n", writer.checksum);
+    }
+    else if (decompress) {
+        if (!reader.mapped)
+            fill_buffer (&reader);
+
+        if (reader.mapped ? lzw_is_frame (reader.mapped, reader.mapped_size) : lzw_is_frame (reader.buffer, reader.tail)) {
+            if (lzw_frame_decompress (write_block, &writer, read_block, &reader, threads)) {
+                fprintf (stderr, "lzw_frame_decompress() returned non-zero!\n");
+                return 1;
+            }
+        }
+        else if (reader.mapped || dictionary || checkpoints ? PROCESS_STREAM (1) :
+#ifdef LZW_STATS
+            lzw_decompress_stats (write_buff, &writer, read_buff, &reader, &stats, verbose > 1 ? display_event : NULL, NULL)) {
+#else
+            lzw_decompress (write_buff, &writer, read_buff, &reader)) {
+#endif
             fprintf (stderr, "lzw_decompress() returned non-zero!\n");
             return 1;
         }
 
         write_buff (EOF, &writer);
-            
+        update_checksum (&reader);
+
         if (verbose && writer.byte_count)
-            fprintf (stderr, "output checksum = %x, ratio = %.2f%%\n", writer.checksum, reader.byte_count * 100.0 / writer.byte_count);
+            fprintf (stderr, "output CRC32C = %08x, ratio = %.2f%%\n", writer.checksum, reader.byte_count * 100.0 / writer.byte_count);
+
+#ifdef LZW_STATS
+        if (verbose && stats.codes)
+            display_stats (&stats);
+#endif
+    }
+    else if (framed) {
+        if (lzw_frame_compress (write_block, &writer, read_block, &reader, maxbits, block_size, threads, flags)) {
+            fprintf (stderr, "lzw_frame_compress() returned non-zero!\n");
+            return 1;
+        }
+
+        write_buff (EOF, &writer);
+        update_checksum (&reader);
+
+        if (verbose && reader.byte_count)
+            fprintf (stderr, "source CRC32C = %08x, ratio = %.2f%%\n", reader.checksum, writer.byte_count * 100.0 / reader.byte_count);
     }
     else {
-        if (lzw_compress (write_buff, &writer, read_buff, &reader, maxbits)) {
+        if (reader.mapped || dictionary ? PROCESS_STREAM (0) :
+#ifdef LZW_STATS
+            lzw_compress_stats (write_buff, &writer, read_buff, &reader, maxbits, &stats, verbose > 1 ? display_event : NULL, NULL)) {
+#else
+            lzw_compress (write_buff, &writer, read_buff, &reader, maxbits)) {
+#endif
             fprintf (stderr, "lzw_compress() returned non-zero!\n");
             return 1;
         }
 
         write_buff (EOF, &writer);
+        update_checksum (&reader);
 
         if (verbose && reader.byte_count)
-            fprintf (stderr, "source checksum = %x, ratio = %.2f%%\n", reader.checksum, writer.byte_count * 100.0 / reader.byte_count);
+            fprintf (stderr, "source CRC32C = %08x, ratio = %.2f%%\n", reader.checksum, writer.byte_count * 100.0 / reader.byte_count);
+#ifdef LZW_STATS
+        if (verbose && stats.codes)
+            display_stats (&stats);
+#endif
+    }
+
+    stop_pipelining (&reader, 0);
+
+    if (stop_pipelining (&writer, 1)) {
+        fprintf (stderr, "error writing output!\n");
+        return 1;
     }
 
+    if (checkpoints && fclose (checkpoints) && !range) {
+        fprintf (stderr, "error writing checkpoint file!\n");
+        return 1;
+    }
+
+#ifdef MAPPED_INPUT
+    unmap_stdin (&reader);
+#endif
+    free (reader.allocated);
+
+    if (dictionary)
+        lzw_dictionary_free (dictionary);
+
     return 0;
 }
@@ -0,0 +1,62 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZWFRAME_H_
+#define LZWFRAME_H_
+
+#include <stddef.h>
+
+// The framed format allocates its blocks, threads and index (and uses the allocating
+// buffer functions), so it's not available when the library is built without malloc().
+
+#ifdef LZW_NO_MALLOC
+#error "lzwframe.c can't be built with LZW_NO_MALLOC (it needs malloc())"
+#endif
+
+// Block I/O callbacks for the framed format. The read function works like fread() (it
+// returns fewer bytes than requested only at EOF) and the write function returns non-zero
+// on an error.
+
+typedef size_t (*lzw_read_fn) (void *buffer, size_t size, void *ctx);
+typedef int (*lzw_write_fn) (const void *buffer, size_t size, void *ctx);
+
+#define LZW_FRAME_MAGIC         "LZWF"
+#define LZW_FRAME_MAGIC_SIZE    4
+#define LZW_FRAME_BLOCK_SIZE    (1024 * 1024)       // default block size
+#define LZW_FRAME_MAX_BLOCK     (1024 * 1024 * 1024)
+#define LZW_FRAME_MAX_THREADS   256
+
+#define LZW_FRAME_INDEX         0x01                // append an index for random access
+#define LZW_FRAME_CHECKSUM      0x02                // store CRC32C checksums of the uncompressed data
+#define LZW_FRAME_STORED        0x04                // store blocks that don't compress (uncompressed)
+
+int lzw_is_frame (const void *header, size_t header_size);
+unsigned int lzw_crc32c (unsigned int crc, const void *buffer, size_t size);
+
+int lzw_frame_compress (lzw_write_fn dst, void *dstctx, lzw_read_fn src, void *srcctx, int maxbits, size_t block_size, int threads, int flags);
+int lzw_frame_decompress (lzw_write_fn dst, void *dstctx, lzw_read_fn src, void *srcctx, int threads);
+
+// Pick the smallest "maxbits" (9 to "max_maxbits") that compresses the sample to within "tolerance"
+// per mille of the best setting, by trial compression on up to "threads" threads (-1 on error).
+
+#define LZW_SELECT_SAMPLE       (1024 * 1024)       // suggested sample size (from the start of the data)
+
+int lzw_select_maxbits (const void *sample, size_t sample_size, int max_maxbits, int tolerance, int threads);
+
+// Random access to indexed frames. The "pread" callback reads "size" bytes at "position" (from
+// the start of the frame) and returns the number of bytes read.
+
+typedef size_t (*lzw_pread_fn) (void *buffer, size_t size, unsigned long long position, void *ctx);
+typedef struct lzw_reader lzw_reader_t;
+
+lzw_reader_t *lzw_reader_open (lzw_pread_fn pread, void *ctx, unsigned long long frame_size);
+unsigned long long lzw_reader_size (lzw_reader_t *reader);
+int lzw_read_at (lzw_reader_t *reader, unsigned long long offset, void *dst, size_t *length);
+void lzw_reader_close (lzw_reader_t *reader);
+
+#endif /* LZWFRAME_H_ */
@@ -71,28 +71,77 @@
  * 16 bits) and determines the RAM footprint required by both sides and, to a
  * large extent, the compression performance. This information is communicated
  * to the decoder in the first stream byte so that it can allocate accordingly.
- * The RAM requirements are as follows:
+ * The RAM requirements are as follows (and are also available at runtime from
+ * lzw_workspace_size()):
  *
  *    maximum    encoder RAM   decoder RAM
  *  symbol size  requirement   requirement
  * -----------------------------------------
- *     9-bit      4096 bytes    2368 bytes
- *    10-bit      8192 bytes    4992 bytes
- *    11-bit     16384 bytes   10240 bytes
- *    12-bit     32768 bytes   20736 bytes
- *    13-bit     65536 bytes   41728 bytes
- *    14-bit    131072 bytes   83712 bytes
- *    15-bit    262144 bytes  167680 bytes
- *    16-bit    524288 bytes  335616 bytes
+ *     9-bit      4096 bytes    2369 bytes
+ *    10-bit      8192 bytes    4993 bytes
+ *    11-bit     16384 bytes   10241 bytes
+ *    12-bit     32768 bytes   20737 bytes
+ *    13-bit     65536 bytes   41729 bytes
+ *    14-bit    131072 bytes   83713 bytes
+ *    15-bit    262144 bytes  167681 bytes
+ *    16-bit    524288 bytes  335617 bytes
  *
- * This implementation uses malloc(), but obviously an embedded version could
- * use static arrays instead if desired (assuming that the maxbits was
- * controlled outside).
+ * By default this storage is obtained with malloc() for each stream, but all
+ * the functions have "_ws" variants that accept a workspace provided by the
+ * caller instead (which must be aligned to LZW_WORKSPACE_ALIGN bytes). This
+ * can be static memory or carved out of an arena, and if LZW_NO_MALLOC is
+ * defined at compile time then the heap is not used at all (and only the
+ * "_ws" variants are available).
+ *
+ * These are the minimum requirements. Given more RAM (which is what happens
+ * with malloc()), the encoder uses a hash table for faster string lookups
+ * and a bitmap for finding entries to recycle (LZW_HASH_ENCODER, about 2.77
+ * times the size shown) and the buffer-to-buffer
+ * decoder copies strings forward (LZW_BUFFER_DECODER, about twice the size).
+ * The compressed data is identical either way.
+ *
+ * For diagnosing compression (or speed) problems, if LZW_STATS is defined then
+ * the encoder and decoder can count what they're doing (codes sent, resets by
+ * cause, string lookups and recycling) and report resets through a callback.
+ * Without LZW_STATS, none of this is compiled.
  */
 
 #define NULL_CODE       65535   // indicates a NULL prefix (must be unsigned short)
 #define CLEAR_CODE      256     // code to flush dictionary and restart decoder
 #define FIRST_STRING    257     // code of first dictionary string
+#define PRESET_FLAG     0x08    // header byte flag: a preset dictionary ID follows (4 bytes)
+#define FLUSH_FLAG      0x10    // header byte flag: the stream can have flush points (see lzw_encoder_flush())
+
+#define MAX_CODE_BYTES  8       // output bytes that must be available to encode one input byte (two 32-bit stores)
+#define CHUNK_SIZE      256     // size of the buffers used to connect the callback functions to the engines
+#define HASH_HEADS      4       // encoder hash chain heads per code (fewer is measurably slower)
+
+// the encoder's leaf bitmap follows the hash table heads, chain links and keys (see encode_bytes())
+
+#define LEAVES(hash_table,total_codes) ((unsigned long long *) ((unsigned int *) ((hash_table) + (total_codes) * (HASH_HEADS + 1)) + (total_codes)))
+
+/* The statistics (if enabled) are gathered with these macros. The code in STATS() only runs if a
+ * statistics structure has been attached to the context (which is the local "stats" pointer), and
+ * STATS_ONLY() is for the declarations and counting that it needs. Without LZW_STATS these are both
+ * empty, so there is no cost at all.
+ */
+
+#ifdef LZW_STATS
+#define STATS(x) do { if (stats) { x; } } while (0)
+#define STATS_ONLY(x) x
+
+static void count_steps (unsigned long long *count, unsigned long long *total, unsigned int *maximum, unsigned int steps)
+{
+    ++*count;
+    *total += steps;
+
+    if (steps > *maximum)
+        *maximum = steps;
+}
+#else
+#define STATS(x) do { } while (0)
+#define STATS_ONLY(x)
+#endif
 
 /* This macro determines the number of bits required to represent the given value,
  * not counting the implied MSB. For GNU C it will use the provided built-in,
@@ -108,9 +157,68 @@
             ((n) < 16384 ? 12 + ((n) >= 8192) : 14 + ((n) >= 32768)))
 #endif
 
+/* Similarly, this returns the index of the lowest set bit in a (non-zero) 64-bit word. The non-GNU
+ * version isolates the bit and uses a de Bruijn sequence to look up its index.
+ */
+
+#ifdef __GNUC__
+#define LOWEST_BIT(w) __builtin_ctzll(w)
+#else
+static const unsigned char debruijn_index [64] = {
+     0,  1, 48,  2, 57, 49, 28,  3, 61, 58, 50, 42, 38, 29, 17,  4,
+    62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12,  5,
+    63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+    46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19,  9, 13,  8,  7,  6
+};
+
+#define LOWEST_BIT(w) debruijn_index [(((w) & (0 - (w))) * 0x03f79d71b4cb0a89ULL) >> 58]
+#endif
+
+/* Start loading the cache line at "p" (only a hint, so it's nothing for compilers without the built-in) */
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch (p)
+#else
+#define PREFETCH(p) do { } while (0)
+#endif
+
+/* The main loops of the engines are "kernels" that take "maxbits" and the phase (0 while the dictionary
+ * is filling, 1 once it's full and entries are being recycled) as their last two arguments. They're always
+ * inlined, and DISPATCH() calls them with constants, so the compiler generates a separate loop for every
+ * combination in which everything that depends on "maxbits" is a constant and the checks for the phase
+ * disappear. Once the dictionary is full, "maxcode" is fixed at total_codes - 1, so every code is a long
+ * one ("maxbits" bits) and the symbol size calculations disappear too. A kernel runs until it has to
+ * stop (input or output) or the phase changes (the dictionary fills, or is cleared after it was full), in
+ * which case it returns KERNEL_PHASE and is dispatched again.
+ */
+
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline
+#endif
+
+#define KERNEL_DONE     0       // stopped normally (input or output exhausted, or END_CODE received)
+#define KERNEL_PHASE    1       // the phase changed, so dispatch again
+#define KERNEL_INPUT    2       // (decoders) stopped in the middle of a code for more input
+#define KERNEL_ERROR    3       // (buffer decoder) corrupt stream or not enough output space
+
+#define DISPATCH(kernel,maxbits,full,...) switch (((maxbits) - 9) * 2 + ((full) != 0)) {                    \
+    case 0:  return kernel (__VA_ARGS__,  9, 0);    case 1:  return kernel (__VA_ARGS__,  9, 1);            \
+    case 2:  return kernel (__VA_ARGS__, 10, 0);    case 3:  return kernel (__VA_ARGS__, 10, 1);            \
+    case 4:  return kernel (__VA_ARGS__, 11, 0);    case 5:  return kernel (__VA_ARGS__, 11, 1);            \
+    case 6:  return kernel (__VA_ARGS__, 12, 0);    case 7:  return kernel (__VA_ARGS__, 12, 1);            \
+    case 8:  return kernel (__VA_ARGS__, 13, 0);    case 9:  return kernel (__VA_ARGS__, 13, 1);            \
+    case 10: return kernel (__VA_ARGS__, 14, 0);    case 11: return kernel (__VA_ARGS__, 14, 1);            \
+    case 12: return kernel (__VA_ARGS__, 15, 0);    case 13: return kernel (__VA_ARGS__, 15, 1);            \
+    case 14: return kernel (__VA_ARGS__, 16, 0);    default: return kernel (__VA_ARGS__, 16, 1);            \
+}
+
 /* This macro writes the adjusted-binary symbol "code" given the maximum
  * symbol "maxcode". A macro is used here just to avoid the duplication in
- * the lzw_compress() function. The idea is that if "maxcode" is not one
+ * the encoder kernel. The idea is that if "maxcode" is not one
  * less than a power of two (which it rarely will be) then this code can
  * often send fewer bits that would be required with a fixed-sized code.
  *
@@ -118,32 +226,74 @@
  * every "code" would normally consume 9 bits. But with adjusted binary we
  * can actually represent any code from 0 to 253 with just 8 bits -- only
  * the 4 codes from 254 to 257 take 9 bits.
+ *
+ * The bits accumulate in a 64-bit "shifter" and are stored through the "dst"
+ * pointer 32 at a time, so fewer than 32 bits are ever left pending and it's
+ * up to the caller to make sure that there's room for 4 bytes. The ratio
+ * check still counts every byte as it's completed (the stream depends on it).
  */
 
-#define WRITE_CODE(code,maxcode) do {                               \
-    unsigned int code_bits = CODE_BITS (maxcode);                   \
-    unsigned int extras = (2 << code_bits) - (maxcode) - 1;         \
-    if ((code) < extras) {                                          \
-        shifter |= ((code) << bits);                                \
-        bits += code_bits;                                          \
-    }                                                               \
-    else {                                                          \
-        shifter |= ((((code) + extras) >> 1) << bits);              \
-        bits += code_bits;                                          \
-        shifter |= ((((code) + extras) & 1) << bits++);             \
-    }                                                               \
-    do { (*dst)(shifter,dstctx); shifter >>= 8;                     \
-        output_bytes += 256;                                        \
-    } while ((bits -= 8) >= 8);                                     \
+#define WRITE_CODE(code,maxcode) do {                                       \
+    unsigned int code_bits = CODE_BITS (maxcode);                           \
+    unsigned int extras = (2 << code_bits) - (maxcode) - 1;                 \
+    unsigned int long_code = (code) >= extras;                              \
+    unsigned int value = long_code ?                                        \
+        (((code) + extras) >> 1) | (((code) + extras) & 1) << code_bits :   \
+        (code);                                                             \
+    shifter |= (unsigned long long) value << bits;                          \
+    output_bytes += (((bits & 7) + code_bits + long_code) >> 3) << 8;       \
+    bits += code_bits + long_code;                                          \
+    STATS (stats->codes++; stats->code_bits += code_bits + long_code);      \
+    if (bits >= 32) {                                                       \
+        STORE32_LE (dst, shifter);                                          \
+        shifter >>= 32; bits -= 32; dst += 4;                               \
+    }                                                                       \
 } while (0)
 
-/* LZW compression function. Bytes (8-bit) are read and written through callbacks and the
- * "maxbits" parameter specifies the maximum symbol size (9-16), which in turn determines
- * the RAM requirement and, to a large extent, the level of compression achievable. A return
- * value of EOF from the "src" callback terminates the compression process. A non-zero return
- * value indicates one of the two possible errors -- bad "maxbits" param or failed malloc().
- * There are contexts (void pointers) that are passed to the callbacks to easily facilitate
- * multiple instances of the compression operation (but simple applications can ignore these).
+/* The decoders read into a 64-bit "shifter" from the bottom. Whenever a code might not be
+ * available and there are at least 8 bytes of input left, this loads all 8 and keeps the
+ * whole bytes that fit (at least 7 bytes, leaving between 56 and 63 bits). The top bits
+ * from the partially loaded byte are harmless because that byte is loaded again later into
+ * exactly the same position. These load and store byte by byte so that they work on any
+ * machine (and with any alignment) and compilers turn them into single instructions.
+ */
+
+#define LOAD64_LE(p) ((unsigned long long) (p) [0]       | (unsigned long long) (p) [1] << 8  |   \
+                      (unsigned long long) (p) [2] << 16 | (unsigned long long) (p) [3] << 24 |   \
+                      (unsigned long long) (p) [4] << 32 | (unsigned long long) (p) [5] << 40 |   \
+                      (unsigned long long) (p) [6] << 48 | (unsigned long long) (p) [7] << 56)
+
+#define STORE32_LE(p,v) ((p) [0] = (unsigned char) (v),         (p) [1] = (unsigned char) ((v) >> 8),   \
+                         (p) [2] = (unsigned char) ((v) >> 16), (p) [3] = (unsigned char) ((v) >> 24))
+
+#define REFILL_BITS() do {                                      \
+    shifter |= LOAD64_LE (sp) << bits;                          \
+    sp += (63 - bits) >> 3;                                     \
+    bits |= 56;                                                 \
+} while (0)
+
+/* Once at least "code_bits" bits are in the shifter (plus the extra one if the code turns out to be
+ * a long one), this decodes the next adjusted-binary symbol into "code" without branching and
+ * removes it from the shifter. This leaves "code_bits" as the actual length of the code.
+ */
+
+#define DECODE_CODE(code) do {                                                      \
+    unsigned int long_code;                                                         \
+    code = (unsigned int) shifter & ((1 << code_bits) - 1);                         \
+    long_code = code >= extras;                                                     \
+    code = ((code << long_code) | ((unsigned int) (shifter >> code_bits) & long_code)) - (extras & (0 - long_code));  \
+    code_bits += long_code;                                                         \
+    shifter >>= code_bits;                                                          \
+    bits -= code_bits;                                                              \
+} while (0)
+
+/* The encoder and decoder are implemented as "engines" that keep all of their state in a
+ * context structure (lzw_encoder_t or lzw_decoder_t) and work directly on memory buffers, so
+ * they can be stopped at any point that the input runs out (or the output space does) and
+ * later picked up again. These contexts are available to applications through the streaming
+ * functions (lzw_encoder_feed(), etc.), which makes it possible to run any number of streams
+ * from an event loop without blocking. The functions that work with callbacks or with complete
+ * buffers are just thin wrappers around the streaming functions.
  */
 
 typedef struct {
@@ -151,42 +301,248 @@ typedef struct {
     unsigned char terminator;
 } encoder_entry_t;
 
-int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits)
+typedef struct {
+    unsigned char terminator, extra_references;
+    unsigned short prefix;
+} decoder_entry_t;
+
+/* Return the number of bytes of workspace required to encode or decode (depending on "mode")
+ * a stream with the specified "maxbits", or zero for a bad "maxbits". Note that a decoder does
+ * not know "maxbits" until it reads the first byte of the stream, so a decoder workspace must
+ * be sized for the largest "maxbits" that the application will accept. The encoder just needs
+ * the dictionary, and the decoder needs the dictionary, the "referenced" bitfield and the
+ * "reverse_buffer" (in that order, which keeps everything aligned). The buffer decoder does not
+ * need the "reverse_buffer", but instead has the offset and length of every string, and the hash
+ * encoder has the hash table after the dictionary (see encode_bytes()).
+ */
+
+size_t lzw_workspace_size (int maxbits, int mode)
+{
+    size_t total_codes = (size_t) 1 << maxbits;
+
+    if (maxbits < 9 || maxbits > 16)
+        return 0;
+
+    if (mode == LZW_ENCODER)
+        return total_codes * sizeof (encoder_entry_t);
+    else if (mode == LZW_HASH_ENCODER)
+        return total_codes * (sizeof (encoder_entry_t) + sizeof (unsigned short) * (HASH_HEADS + 1) + sizeof (unsigned int)) + total_codes / 8;
+    else if (mode == LZW_BUFFER_DECODER)
+        return total_codes * (sizeof (decoder_entry_t) + sizeof (unsigned int) + sizeof (unsigned short)) + total_codes / 8;
+    else
+        return total_codes * sizeof (decoder_entry_t) + total_codes / 8 + total_codes - 255;
+}
+
+// return non-zero if the caller-supplied workspace is not suitable
+
+static int bad_workspace (void *workspace, size_t workspace_size, int maxbits, int mode)
+{
+    return workspace_size < lzw_workspace_size (maxbits, mode) || ((size_t) workspace & (LZW_WORKSPACE_ALIGN - 1));
+}
+
+/* Initialize an encoder context for the specified "maxbits" (9-16) using the provided workspace,
+ * which must be at least lzw_workspace_size (maxbits, LZW_ENCODER) bytes and aligned. If it's at
+ * least LZW_HASH_ENCODER bytes, then the hash table (and leaf bitmap) is used to speed things up. If "workspace"
+ * is NULL, then the storage (with hash table) is allocated with malloc(). A non-zero return value
+ * indicates one of the possible errors -- bad "maxbits" param, unsuitable workspace or failed malloc().
+ * Note that the header byte indicating "maxbits" is the first thing sent by lzw_encoder_feed().
+ * Internally, the hash table heads can instead be copied from "hash_heads" (for a preset dictionary).
+ */
+
+static int encoder_init (lzw_encoder_t *enc, int maxbits, void *workspace, size_t workspace_size, const unsigned short *hash_heads)
 {
-    unsigned int maxcode = FIRST_STRING, next_string = FIRST_STRING, prefix = NULL_CODE, total_codes;
-    unsigned int dictionary_full = 0, available_entries, max_available_entries, max_available_code;
-    unsigned int input_bytes = 65536, output_bytes = 65536;
-    unsigned int shifter = 0, bits = 0;
-    encoder_entry_t *dictionary;
-    int c;
+    memset (enc, 0, sizeof (lzw_encoder_t));
 
     if (maxbits < 9 || maxbits > 16)    // check for valid "maxbits" setting
         return 1;
 
-    // based on the "maxbits" parameter, compute total codes and allocate dictionary storage
+    // based on the "maxbits" parameter, compute total codes and allocate dictionary storage (if required)
 
-    total_codes = 1 << maxbits;
-    dictionary = malloc (total_codes * sizeof (encoder_entry_t));
-    max_available_entries = total_codes - FIRST_STRING - 1;
-    max_available_code = total_codes - 2;
+    if (!workspace) {
+#ifndef LZW_NO_MALLOC
+        workspace = malloc (workspace_size = lzw_workspace_size (maxbits, LZW_HASH_ENCODER));
+        enc->allocated = 1;
+#endif
+    }
+    else if (bad_workspace (workspace, workspace_size, maxbits, LZW_ENCODER))
+        return 1;
 
-    if (!dictionary)
+    if (!workspace)
         return 1;                       // failed malloc()
 
+    enc->dictionary = workspace;
+    enc->total_codes = 1 << maxbits;
+
+    if (workspace_size >= lzw_workspace_size (maxbits, LZW_HASH_ENCODER)) {
+        enc->hash_table = (unsigned short *) ((encoder_entry_t *) enc->dictionary + enc->total_codes);
+
+        if (hash_heads)
+            memcpy (enc->hash_table, hash_heads, enc->total_codes * HASH_HEADS * sizeof (unsigned short));
+        else
+            memset (enc->hash_table, 0, enc->total_codes * HASH_HEADS * sizeof (unsigned short));
+
+        memset (LEAVES (enc->hash_table, enc->total_codes), 0, enc->total_codes / 8);
+    }
+
+    enc->max_available_entries = enc->total_codes - FIRST_STRING - 1;
+    enc->max_available_code = enc->total_codes - 2;
+
     // clear the dictionary
 
-    available_entries = max_available_entries;
-    memset (dictionary, 0, 256 * sizeof (encoder_entry_t));
+    enc->available_entries = enc->max_available_entries;
+    memset (enc->dictionary, 0, 256 * sizeof (encoder_entry_t));
+
+    enc->maxcode = enc->next_string = FIRST_STRING;
+    enc->input_bytes = enc->output_bytes = 65536;
+    enc->prefix = NULL_CODE;
+
+    enc->held [enc->held_count++] = maxbits - 9;    // first byte in output stream indicates the maximum symbol bits
+    return 0;
+}
+
+int lzw_encoder_init_ws (lzw_encoder_t *enc, int maxbits, void *workspace, size_t workspace_size)
+{
+    return encoder_init (enc, maxbits, workspace, workspace_size, NULL);
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_encoder_init (lzw_encoder_t *enc, int maxbits)
+{
+    return lzw_encoder_init_ws (enc, maxbits, NULL, 0);
+}
+
+#endif
+
+/* Release the storage for an encoder context (if we allocated it). This is done automatically when
+ * lzw_encoder_finish() completes, so it's only required if an application abandons a stream before
+ * that.
+ */
+
+void lzw_encoder_free (lzw_encoder_t *enc)
+{
+#ifndef LZW_NO_MALLOC
+    if (enc->allocated)
+        free (enc->dictionary);
+#endif
+    enc->dictionary = NULL;
+}
+
+#ifdef LZW_STATS
+
+/* Attach a statistics structure (which is added to, not cleared) to an initialized encoder context,
+ * along with an optional "event" callback for resets and the dictionary filling (see lzwlib.h).
+ */
+
+void lzw_encoder_stats (lzw_encoder_t *enc, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx)
+{
+    enc->stats = stats;
+    enc->event = event;
+    enc->event_ctx = event_ctx;
+
+    if (stats)
+        stats->output_bytes += enc->held_count - enc->held_index;   // the header byte (if not already sent)
+}
+
+#endif
+
+/* When the workspace allows, the encoder finds strings with a hash table instead of searching through
+ * the "next_reference" lists, which get long at the larger symbol sizes and cause a cache miss at every
+ * step. The table has HASH_HEADS chain heads per code (indexed by a hash of the prefix and terminator,
+ * which together are the "key"), and the chains are linked through "hash_next". We also store the key of
+ * every string to check for matches (and to find them again for removal). Every string in the dictionary
+ * is in the table, which means strings must be removed when they're recycled, and on a CLEAR_CODE we zero
+ * the heads of all the strings that were in use (which is much faster than clearing the whole table when
+ * the dictionary is small, as it is after an early CLEAR_CODE on uncompressible data).
+ *
+ * Note that the strings are then added to the front of the "next_reference" lists (rather than the end)
+ * because we don't search them anymore. The order doesn't affect the output because these lists are only
+ * used to know whether a string is referenced and to remove recycled entries.
+ *
+ * The same workspace also has a bitmap of the "leaves" (the strings that no longer strings are based on,
+ * i.e., the ones with no "first_reference"), which are the strings that can be recycled. Once the dictionary
+ * is full, the next one to recycle is found by searching this 64 bits at a time, instead of checking every
+ * entry, which limits the work for each byte (the whole dictionary can otherwise be scanned for one string).
+ * The bits are kept for strings FIRST_STRING to "max_available_code", which are the ones that are searched.
+ */
+
+#define HASH_SHIFT(total_codes) (31 - CODE_BITS (HASH_HEADS) - CODE_BITS ((total_codes) - 1))
+#define HASH(key) (((key) * 2654435761U & 0xffffffffU) >> hash_shift)
+
+#define SET_LEAF(code) (leaves [(code) >> 6] |= 1ULL << ((code) & 63))
+#define CLEAR_LEAF(code) (leaves [(code) >> 6] &= ~(1ULL << ((code) & 63)))
+
+// clear the hash table heads (and leaves) of the strings from FIRST_STRING to "end_code" - 1
+
+static void clear_hash (unsigned short *hash_table, unsigned int end_code, unsigned int total_codes)
+{
+    unsigned int hash_shift = HASH_SHIFT (total_codes), code;
+    unsigned int *keys = (unsigned int *) (hash_table + total_codes * (HASH_HEADS + 1));
 
-    (*dst)(maxbits - 9, dstctx);    // first byte in output stream indicates the maximum symbol bits
+    for (code = FIRST_STRING; code < end_code; code++)
+        hash_table [HASH (keys [code])] = 0;
+
+    memset (LEAVES (hash_table, total_codes), 0, ((end_code + 63) >> 6) * sizeof (unsigned long long));
+}
+
+// return the first leaf at or after "code" (wrapping around, and there must be at least one)
+
+static unsigned int next_leaf (const unsigned long long *leaves, unsigned int code, unsigned int total_codes)
+{
+    unsigned int index = code >> 6, words = total_codes >> 6;
+    unsigned long long word = index < words ? leaves [index] & (~0ULL << (code & 63)) : 0;
+
+    while (!word) {
+        if (++index >= words)
+            index = 0;
+
+        word = leaves [index];
+    }
+
+    return (index << 6) + LOWEST_BIT (word);
+}
+
+// in the kernels, "maxcode" is a constant once the dictionary is full (the compiler might not see that)
+
+#define MAXCODE (full ? total_codes - 1 : maxcode)
+
+/* The encoder kernel (see DISPATCH()). This compresses bytes from "*spp" up to "src_end" and stores
+ * the output at "*dstp" (both are advanced). Input is only consumed while there is room for the
+ * worst-case output of a single byte (MAX_CODE_BYTES) before "dst_end".
+ */
+
+static FORCE_INLINE int encode_codes (lzw_encoder_t *enc, const unsigned char **spp, const unsigned char *src_end,
+    unsigned char **dstp, unsigned char *dst_end, const unsigned int maxbits, const unsigned int full)
+{
+    const unsigned int total_codes = 1 << maxbits, max_available_code = total_codes - 2;
+    const unsigned int max_available_entries = total_codes - FIRST_STRING - 1, hash_shift = HASH_SHIFT (total_codes);
+    unsigned int maxcode = full ? total_codes - 1 : enc->maxcode, next_string = enc->next_string, prefix = enc->prefix;
+    unsigned int dictionary_full = full, available_entries = enc->available_entries;
+    unsigned int input_bytes = enc->input_bytes, output_bytes = enc->output_bytes, bits = enc->bits;
+    unsigned long long shifter = enc->shifter;
+    encoder_entry_t *dictionary = enc->dictionary;
+    unsigned short *hash_table = enc->hash_table, *hash_next = NULL;
+    unsigned long long *leaves = NULL;
+    unsigned int *keys = NULL;
+    const unsigned char *sp = *spp;
+    unsigned char *dst = *dstp;
+    int result = 0;
+    STATS_ONLY (lzw_stats_t *stats = enc->stats;)
+
+    if (hash_table) {
+        hash_next = hash_table + total_codes * HASH_HEADS;
+        keys = (unsigned int *) (hash_next + total_codes);
+        leaves = LEAVES (hash_table, total_codes);
+    }
 
     // This is the main loop where we read input bytes and compress them. We always keep track of the
     // "prefix", which represents a pending byte (if < 256) or string entry (if >= FIRST_STRING) that
     // has not been sent to the decoder yet. The output symbols are kept in the "shifter" and "bits"
-    // variables and are sent to the output every time 8 bits are available (done in the macro).
+    // variables and are sent to the output every time 32 bits are available (done in the macro).
 
-    while ((c = (*src)(srcctx)) != EOF) {
-        unsigned int cti;                   // coding table index
+    while (sp < src_end && dst_end - dst >= MAX_CODE_BYTES) {
+        unsigned int cti, c = *sp++;        // coding table index and current byte
+        STATS_ONLY (unsigned int steps = 0;)
 
         input_bytes += 256;
 
@@ -197,8 +553,44 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
 
         memset (dictionary + next_string, 0, sizeof (encoder_entry_t));
 
-        if ((cti = dictionary [prefix].first_reference)) {          // if any longer strings are built on the current prefix...
-            while (1)
+        if (hash_table) {
+            unsigned int key = prefix << 8 | c;
+
+            if (sp < src_end)                                       // the next search if this one fails
+                PREFETCH (hash_table + HASH (c << 8 | *sp));
+
+            for (cti = hash_table [HASH (key)]; cti; cti = hash_next [cti]) {
+                STATS_ONLY (steps++;)
+
+                if (keys [cti] == key)
+                    break;
+            }
+
+            if (cti) {                                              // found it, so just extend the prefix
+                prefix = cti;
+
+                if (sp < src_end)                                   // (and start on the next search)
+                    PREFETCH (hash_table + HASH (cti << 8 | *sp));
+            }
+            else {                                                  // otherwise add the new string to the front of the
+                unsigned int first_reference = dictionary [prefix].first_reference;     // prefix's list
+
+                if (first_reference)
+                    dictionary [first_reference].back_reference = next_string;
+                else if (prefix >= FIRST_STRING) {
+                    available_entries--;
+                    CLEAR_LEAF (prefix);
+                }
+
+                dictionary [next_string].next_reference = first_reference;
+                dictionary [next_string].back_reference = prefix;
+                dictionary [prefix].first_reference = next_string;
+            }
+        }
+        else if ((cti = dictionary [prefix].first_reference)) {          // if any longer strings are built on the current prefix...
+            while (1) {
+                STATS_ONLY (steps++;)
+
                 if (dictionary [cti].terminator == c) {             // we found a matching string, so we just update the prefix
                     prefix = cti;                                   // to that string and continue without sending anything
                     break;
@@ -212,6 +604,7 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
                 }
                 else
                     cti = dictionary [cti].next_reference;          // there are more possible matches to check, so loop back
+            }
         }
         else {                                                      // no longer strings are based on the current prefix, so now
             dictionary [prefix].first_reference = next_string;      // the current prefix plus the new byte will be the next string
@@ -219,13 +612,25 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
             if (prefix >= FIRST_STRING) available_entries--;        // the codes 0-255 are never available for recycling
         }
 
+        STATS (count_steps (&stats->lookups, &stats->lookup_steps, &stats->max_lookup_steps, steps));
+
         // If "cti" is zero, we could not simply extend our "prefix" to a longer string because we did not find a
         // dictionary match, so we send the symbol representing the current "prefix" and add the new string to the
         // dictionary. Since the current byte "c" was not included in the prefix, that now becomes our new prefix.
 
         if (!cti) {
-            WRITE_CODE (prefix, maxcode);               // send symbol for current prefix (0 to maxcode-1)
+            WRITE_CODE (prefix, MAXCODE);               // send symbol for current prefix (0 to maxcode-1)
             dictionary [next_string].terminator = c;    // newly created string has current byte as the terminator
+
+            if (hash_table) {                           // add new string to the hash table
+                unsigned int key = prefix << 8 | c, hash = HASH (key);
+
+                hash_next [next_string] = hash_table [hash];
+                hash_table [hash] = next_string;
+                keys [next_string] = key;
+                SET_LEAF (next_string);
+            }
+
             prefix = c;                                 // current byte also becomes new prefix for next string
 
             // If the dictionary is not full yet, we bump the maxcode and next_string and check to see if the
@@ -233,9 +638,13 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
             // less than total_codes because every string entry is now available for matching, but the actual
             // maximum code is reserved for EOF.
 
-            if (!dictionary_full) {
+            if (!full) {
                 dictionary_full = (++next_string > max_available_code);
                 maxcode++;
+
+                if (dictionary_full)
+                    STATS (stats->dictionary_fulls++;
+                        if (enc->event) enc->event (LZW_EVENT_DICTIONARY_FULL, stats, enc->event_ctx));
             }
 
             // If the dictionary is full we look for an entry to recycle starting at next_string (the one we
@@ -243,10 +652,29 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
             // a minimum the string we just added. This also takes care of removing the entry to be recycled
             // (which is possible/easy because no longer strings have been based on it).
 
-            if (dictionary_full) {
-                for (next_string++; next_string <= max_available_code || (next_string = FIRST_STRING); next_string++)
-                    if (!dictionary [next_string].first_reference)
-                        break;
+            if (full || dictionary_full) {
+                STATS_ONLY (unsigned int start = next_string;)
+
+                if (leaves) {
+                    next_string = next_leaf (leaves, next_string + 1, total_codes);
+                    CLEAR_LEAF (next_string);
+                }
+                else
+                    for (next_string++; next_string <= max_available_code || (next_string = FIRST_STRING); next_string++)
+                        if (!dictionary [next_string].first_reference)
+                            break;
+
+                STATS (count_steps (&stats->recycles, &stats->recycle_steps, &stats->max_recycle_steps,
+                    next_string > start ? next_string - start : next_string + max_available_code + 1 - FIRST_STRING - start));
+
+                if (hash_table) {                               // remove the entry to be recycled from the hash table
+                    unsigned short *hp = hash_table + HASH (keys [next_string]);
+
+                    while (*hp != next_string)
+                        hp = hash_next + *hp;
+
+                    *hp = hash_next [next_string];
+                }
 
                 cti = dictionary [next_string].back_reference;  // dictionary [cti] references the entry we're
                                                                 // trying to recycle (either as a first or a next)
@@ -256,8 +684,10 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
 
                     // if we just cleared a first reference, and that string is not 0-255,
                     // then that's a newly available entry
-                    if (!dictionary [cti].first_reference && cti >= FIRST_STRING)
+                    if (!dictionary [cti].first_reference && cti >= FIRST_STRING) {
                         available_entries++;
+                        if (leaves) SET_LEAF (cti);
+                    }
                 }
                 else if (dictionary [cti].next_reference == next_string)    // fixup a "next_reference"
                     dictionary [cti].next_reference = dictionary [next_string].next_reference;
@@ -278,8 +708,11 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
                     // clear the dictionary and reset the byte counters -- basically everything starts over
                     // except that we keep the last pending "prefix" (which, of course, was never sent)
 
-                    WRITE_CODE (CLEAR_CODE, maxcode);
+                    WRITE_CODE (CLEAR_CODE, MAXCODE);
+                    STATS (stats->clear_codes++; stats->floor_resets++;
+                        if (enc->event) enc->event (LZW_EVENT_FLOOR_RESET, stats, enc->event_ctx));
                     memset (dictionary, 0, 256 * sizeof (encoder_entry_t));
+                    if (hash_table) clear_hash (hash_table, max_available_code + 1, total_codes);
                     available_entries = max_available_entries;
                     next_string = maxcode = FIRST_STRING;
                     input_bytes = output_bytes = 65536;
@@ -293,8 +726,11 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
             // dictionary no longer compresses the incoming stream.
 
             if (output_bytes > input_bytes + (input_bytes >> 4)) {
-                WRITE_CODE (CLEAR_CODE, maxcode);
+                WRITE_CODE (CLEAR_CODE, MAXCODE);
+                STATS (stats->clear_codes++; stats->ratio_resets++;
+                    if (enc->event) enc->event (LZW_EVENT_RATIO_RESET, stats, enc->event_ctx));
                 memset (dictionary, 0, 256 * sizeof (encoder_entry_t));
+                if (hash_table) clear_hash (hash_table, dictionary_full ? max_available_code + 1 : next_string, total_codes);
                 available_entries = max_available_entries;
                 next_string = maxcode = FIRST_STRING;
                 input_bytes = output_bytes = 65536;
@@ -304,210 +740,1635 @@ int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void
                 output_bytes -= output_bytes >> 8;
                 input_bytes -= input_bytes >> 8;
             }
+
+            if (dictionary_full != full) {      // the dictionary filled or was cleared, so switch kernels
+                result = KERNEL_PHASE;
+                break;
+            }
         }
     }
 
-    // we're done with input, so if we've received anything we still need to send that pesky pending prefix...
+    enc->maxcode = maxcode; enc->next_string = next_string; enc->prefix = prefix;
+    enc->dictionary_full = dictionary_full; enc->available_entries = available_entries;
+    enc->input_bytes = input_bytes; enc->output_bytes = output_bytes;
+    enc->shifter = (unsigned int) shifter; enc->bits = bits;
 
-    if (prefix != NULL_CODE) {
-        WRITE_CODE (prefix, maxcode);
+    *spp = sp;
+    *dstp = dst;
+    return result;
+}
 
-        if (!dictionary_full)
-            maxcode++;
-    }
+static int encode_kernel (lzw_encoder_t *enc, const unsigned char **spp, const unsigned char *src_end, unsigned char **dstp, unsigned char *dst_end)
+{
+    DISPATCH (encode_codes, CODE_BITS (enc->total_codes), enc->dictionary_full, enc, spp, src_end, dstp, dst_end)
+}
 
-    WRITE_CODE (maxcode, maxcode);  // the maximum possible code is always reserved for our END_CODE
+/* Compress as many of the "src_size" bytes at "src" as possible, storing the output at "*dstp"
+ * (which is advanced). Input is only consumed while there is room for the worst-case output
+ * of a single byte (MAX_CODE_BYTES) before "dst_end". Returns the number of bytes consumed.
+ */
+
+static size_t encode_bytes (lzw_encoder_t *enc, unsigned char **dstp, unsigned char *dst_end, const unsigned char *src, size_t src_size)
+{
+    const unsigned char *sp = src;
 
-    if (bits)                       // finally, flush any pending bits from the shifter
-        (*dst)(shifter, dstctx);
+    while (encode_kernel (enc, &sp, src + src_size, dstp, dst_end) == KERNEL_PHASE);
 
-    free (dictionary);
-    return 0;
+    return sp - src;
 }
 
-/* LZW decompression function. Bytes (8-bit) are read and written through callbacks. The
- * "maxbits" parameter is read as the first byte in the stream and controls how much memory
- * is allocated for decoding. A return value of EOF from the "src" callback terminates the
- * decompression process (although this should not normally occur). A non-zero return value
- * indicates an error, which in this case can be a bad "maxbits" read from the stream, a
- * failed malloc(), or if an EOF is read from the input stream before the decompression
- * terminates naturally with END_CODE. There are contexts (void pointers) that are passed
- * to the callbacks to easily facilitate multiple instances of the decompression operation
- * (but simple applications can ignore these).
+/* Send the pending prefix (if there is one) and the END_CODE, and then the bits in the shifter (padded
+ * to a byte boundary) at "*dstp" (which is advanced). There must be room for at least 9 bytes of output
+ * (up to 31 pending bits plus two codes). This terminates the stream, unless the stream is flushable and
+ * there was a pending prefix, in which case it's a flush point and we carry on from a byte boundary with
+ * nothing pending. Note that "maxcode" is not advanced for the prefix sent here (because no string is
+ * added for it) and the decoder takes that into account.
  */
 
-typedef struct {
-    unsigned char terminator, extra_references;
-    unsigned short prefix;
-} decoder_entry_t;
-
-int lzw_decompress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx)
+static void encode_end (lzw_encoder_t *enc, unsigned char **dstp)
 {
-    unsigned int maxcode = FIRST_STRING, next_string = FIRST_STRING - 1, prefix = CLEAR_CODE;
-    unsigned int dictionary_full = 0, max_available_code, total_codes;
-    unsigned int shifter = 0, bits = 0, read_byte, i;
-    unsigned char *reverse_buffer, *referenced;
-    decoder_entry_t *dictionary;
-
-    if ((read_byte = ((*src)(srcctx))) == EOF || (read_byte & 0xf8))  //sanitize first byte
-        return 1;
+    unsigned int maxcode = enc->maxcode, bits = enc->bits, output_bytes = enc->output_bytes;
+    unsigned long long shifter = enc->shifter;
+    unsigned char *dst = *dstp;
+    STATS_ONLY (lzw_stats_t *stats = enc->stats;)
 
-    // based on the "maxbits" parameter, compute total codes and allocate dictionary storage
+    // we're done with input, so if we've received anything we still need to send that pesky pending prefix...
 
-    total_codes = 512 << (read_byte & 0x7);
-    max_available_code = total_codes - 2;
-    dictionary = malloc (total_codes * sizeof (decoder_entry_t));
-    reverse_buffer = malloc (total_codes - 256);
-    referenced = malloc (total_codes / 8);  // bitfield indicating code is referenced at least once
+    if (enc->prefix != NULL_CODE) {
+        WRITE_CODE (enc->prefix, maxcode);
 
-    // Note that to implement the dictionary entry recycling we have to keep track of how many
-    // longer strings are based on each string in the dictionary. This can be between 0 (no
-    // references) to 256 (every possible next byte), but unfortunately that's one more value
-    // than what can be stored in a byte. The solution is to have a single bit for each entry
-    // indicating any references (i.e., the code cannot be recycled) and an additional byte
-    // in the dictionary entry struct counting the "extra" references (beyond one).
+        if (!enc->dictionary_full)
+            maxcode++;
+    }
 
-    if (!reverse_buffer || !dictionary)         // check for malloc() failure
-        return 1;
+    WRITE_CODE (maxcode, maxcode);  // the maximum possible code is always reserved for our END_CODE
 
-    for (i = 0; i < 256; ++i) {                 // these never change
-        dictionary [i].prefix = NULL_CODE;
-        dictionary [i].terminator = i;
+    for (; bits >= 8; bits -= 8) {  // finally, flush any pending bits from the shifter
+        *dst++ = (unsigned char) shifter;
+        shifter >>= 8;
     }
 
-    // This is the main loop where we read input symbols. The values range from 0 to the code value
-    // of the "next" string in the dictionary (although the actual "next" code cannot be used yet,
-    // and so we reserve that code for the END_CODE). Note that receiving an EOF from the input
-    // stream is actually an error because we should have gotten the END_CODE first.
+    if (bits)
+        *dst++ = (unsigned char) shifter;
 
-    while (1) {
-        unsigned int code_bits = CODE_BITS (maxcode), code;
-        unsigned int extras = (2 << code_bits) - maxcode - 1;
+    enc->prefix = NULL_CODE;
+    enc->shifter = enc->bits = 0;
+    enc->output_bytes = output_bytes;
+    *dstp = dst;
+}
 
-        do {
-            if ((read_byte = ((*src)(srcctx))) == EOF) {
-                free (dictionary); free (reverse_buffer); free (referenced);
-                return 1;
-            }
+/* Move as many of the "held" bytes to the output as will fit (returns non-zero if any are left) */
 
-            shifter |= read_byte << bits;
-        } while ((bits += 8) < code_bits);
+static int send_held (lzw_encoder_t *enc, unsigned char **dstp, unsigned char *dst_end)
+{
+    while (enc->held_index < enc->held_count && *dstp < dst_end)
+        *(*dstp)++ = enc->held [enc->held_index++];
 
-        // first we assume the code will fit in the minimum number of required bits
+    if (enc->held_index < enc->held_count)
+        return 1;
 
-        code = shifter & ((1 << code_bits) - 1);
-        shifter >>= code_bits;
-        bits -= code_bits;
+    enc->held_index = enc->held_count = 0;
+    return 0;
+}
 
-        // but if code >= extras, then we need to read another bit to calculate the real code
-        // (this is the "adjusted binary" part)
+/* Compress the "*src_size" bytes at "src" into the "*dst_size" bytes of space at "dst". On return,
+ * "*src_size" and "*dst_size" are set to the number of bytes actually consumed and generated. The
+ * only way that not all of the input is consumed is if the output space is filled, and this can be
+ * called with any amount of input or output space (including none). When there's not enough room
+ * for the worst-case output of the next byte, we compress into the small "held" buffer in the context
+ * and send what fits from there. Returns LZW_OK, or LZW_ERROR if the context has not been initialized
+ * (or has already been finished).
+ */
 
-        if (code >= extras) {
-            if (!bits) {
-                if ((read_byte = ((*src)(srcctx))) == EOF) {
-                    free (dictionary); free (reverse_buffer); free (referenced);
-                    return 1;
-                }
+int lzw_encoder_feed (lzw_encoder_t *enc, const void *src, size_t *src_size, void *dst, size_t *dst_size)
+{
+    unsigned char *dp = dst, *dst_end = dp + *dst_size, *hp;
+    STATS_ONLY (lzw_stats_t *stats = enc->stats;)
+    size_t consumed = 0;
 
-                shifter = read_byte;
-                bits = 8;
-            }
+    if (!enc->dictionary || enc->finished) {
+        *src_size = *dst_size = 0;
+        return LZW_ERROR;
+    }
 
-            code = (code << 1) - extras + (shifter & 1);
-            shifter >>= 1;
-            bits--;
-        }
+    enc->started = 1;
 
-        if (code == maxcode)                // sending the maximum code is reserved for the end of the file
-            break;
-        else if (code == CLEAR_CODE) {      // otherwise check for a CLEAR_CODE to start over early
-            next_string = FIRST_STRING - 1;
-            maxcode = FIRST_STRING;
-            dictionary_full = 0;
-        }
-        else if (prefix == CLEAR_CODE) {    // this only happens at the first symbol which is always sent
-            (*dst)(code, dstctx);           // literally and becomes our initial prefix
-            next_string++;
-            maxcode++;
-        }
-        // Otherwise we have a valid prefix so we step through the string from end to beginning storing the
-        // bytes in the "reverse_buffer", and then we send them out in the proper order. One corner-case
-        // we have to handle here is that the string might be the same one that is actually being defined
-        // now (code == next_string).
+    while (!send_held (enc, &dp, dst_end) && consumed < *src_size)
+        if (dst_end - dp >= MAX_CODE_BYTES)
+            consumed += encode_bytes (enc, &dp, dst_end, (const unsigned char *) src + consumed, *src_size - consumed);
         else {
-            unsigned int cti = (code == next_string) ? prefix : code;
-            unsigned char *rbp = reverse_buffer, c;
+            hp = enc->held;
+            consumed += encode_bytes (enc, &hp, enc->held + sizeof (enc->held), (const unsigned char *) src + consumed, *src_size - consumed);
+            enc->held_count = hp - enc->held;
+        }
 
-            do {
-                *rbp++ = dictionary [cti].terminator;
-                if (rbp == reverse_buffer + total_codes - 256) {
-                    free (dictionary); free (reverse_buffer); free (referenced);
-                    return 1;
-                }
-            } while ((cti = dictionary [cti].prefix) != NULL_CODE);
+    *dst_size = dp - (unsigned char *) dst;
+    *src_size = consumed;
+    STATS (stats->input_bytes += consumed; stats->output_bytes += *dst_size);
+    return LZW_OK;
+}
 
-            c = *--rbp;     // the first byte in this string is the terminator for the last string, which is
-                            // the one that we'll create a new dictionary entry for this time
+/* Allow flush points in the stream (see lzw_encoder_flush()). This sets a flag in the header byte, so it
+ * must be done after the encoder is initialized and before anything else. Streams with this flag can't be
+ * decoded by earlier versions of the library, and end with one more code. Returns non-zero if it's too late
+ * (or the context hasn't been initialized).
+ */
 
-            do      // send string in corrected order (except for the terminator which we don't know yet)
-                (*dst)(*rbp, dstctx);
-            while (rbp-- != reverse_buffer);
+int lzw_encoder_allow_flush (lzw_encoder_t *enc)
+{
+    if (!enc->dictionary || enc->started)
+        return 1;
 
-            if (code == next_string) {
-                (*dst)(c,dstctx);
-            }
+    enc->held [0] |= FLUSH_FLAG;
+    enc->flushable = 1;
+    return 0;
+}
 
-            // This should always execute (the conditional is to catch corruptions) and is where we add a new string to
-            // the dictionary, either at the end or elsewhere when we are "recycling" entries that were never referenced
+/* Make everything fed so far decodable right away, without ending the stream. The pending prefix is sent
+ * (rather than held for a longer match) and followed by the END_CODE, which in a flushable stream marks a
+ * flush point, and the output is padded to a byte boundary. Both sides keep their dictionaries, so the
+ * stream carries on with almost nothing lost, which makes it possible to send (for example) a series of
+ * messages over a long-lived connection, with each one decoded completely as soon as it's received. If
+ * nothing has been fed since the last flush, nothing is sent. The output is written into the "*dst_size"
+ * bytes of space at "dst" (and "*dst_size" is set to the number of bytes actually written). Returns
+ * LZW_DONE when the flush is complete, LZW_OK if there was not enough room and this should be called
+ * again with more output space (or lzw_encoder_feed() can be called, which completes it first), or
+ * LZW_ERROR if lzw_encoder_allow_flush() wasn't called or the stream has been finished.
+ */
 
-            if (next_string >= FIRST_STRING && next_string < total_codes) {
-                if (referenced [prefix >> 3] & (1 << (prefix & 7)))     // increment reference count on prefix
-                    dictionary [prefix].extra_references++;
-                else
-                    referenced [prefix >> 3] |= 1 << (prefix & 7);
+int lzw_encoder_flush (lzw_encoder_t *enc, void *dst, size_t *dst_size)
+{
+    unsigned char *dp = dst, *dst_end = dp + *dst_size, *hp;
+    STATS_ONLY (lzw_stats_t *stats = enc->stats;)
 
-                dictionary [next_string].prefix = prefix;       // now update the next dictionary entry with the new string
-                dictionary [next_string].terminator = c;        // (but we're always one behind, so it's not the string just sent)
-                dictionary [next_string].extra_references = 0;  // newly created string has not been referenced
-                referenced [next_string >> 3] &= ~(1 << (next_string & 7));
-            }
+    if (!enc->dictionary || enc->finished || !enc->flushable) {
+        *dst_size = 0;
+        return LZW_ERROR;
+    }
 
-            // If the dictionary is not full yet, we bump the maxcode and next_string and check to see if the
-            // dictionary is now full. If it is we set the dictionary_full flag and set next_string back to the
-            // beginning of the dictionary strings to start recycling them. Note that then maxcode will remain
-            // two less than total_codes because every string entry is available for matching, and the actual
-            // maximum code is reserved for EOF.
+    if (!send_held (enc, &dp, dst_end) && enc->prefix != NULL_CODE) {
+        hp = enc->held;
+        encode_end (enc, &hp);
+        enc->held_count = hp - enc->held;
+        send_held (enc, &dp, dst_end);
+    }
 
-            if (!dictionary_full) {
-                maxcode++;
+    *dst_size = dp - (unsigned char *) dst;
+    STATS (stats->output_bytes += *dst_size);
+    return enc->held_count ? LZW_OK : LZW_DONE;
+}
 
-                if (++next_string > max_available_code) {
-                    dictionary_full = 1;
-                    maxcode--;
-                }
-            }
+/* Terminate the compressed stream, writing the final bytes into the "*dst_size" bytes of space at
+ * "dst" (and setting "*dst_size" to the number of bytes actually written). Returns LZW_DONE when
+ * the stream is complete (at which point the context's storage has been released), or LZW_OK if
+ * there was not enough room and this should be called again with more output space.
+ */
 
-            // If the dictionary is full we look for an entry to recycle starting at next_string (the one we
-            // created or recycled) plus one. We know there is one because at a minimum the string we just added
-            // has not been referenced). This also takes care of removing the entry to be recycled (which is
-            // possible/easy because no longer strings have been based on it).
+int lzw_encoder_finish (lzw_encoder_t *enc, void *dst, size_t *dst_size)
+{
+    unsigned char *dp = dst, *dst_end = dp + *dst_size, *hp;
+    STATS_ONLY (lzw_stats_t *stats = enc->stats;)
 
-            if (dictionary_full) {
-                for (next_string++; next_string <= max_available_code || (next_string = FIRST_STRING); next_string++)
-                    if (!(referenced [next_string >> 3] & (1 << (next_string & 7))))
-                        break;
+    if (!enc->dictionary) {
+        *dst_size = 0;
+        return LZW_ERROR;
+    }
 
-                if (dictionary [dictionary [next_string].prefix].extra_references)
-                    dictionary [dictionary [next_string].prefix].extra_references--;
-                else
-                    referenced [dictionary [next_string].prefix >> 3] &= ~(1 << (dictionary [next_string].prefix & 7));
+    enc->started = 1;
+
+    if (!send_held (enc, &dp, dst_end) && !enc->finished) {
+        hp = enc->held;
+
+        if (enc->flushable && enc->prefix != NULL_CODE)
+            encode_end (enc, &hp);      // a flushable stream ends with an END_CODE right after a flush point
+
+        encode_end (enc, &hp);
+        enc->held_count = hp - enc->held;
+        enc->finished = 1;
+        send_held (enc, &dp, dst_end);
+    }
+
+    *dst_size = dp - (unsigned char *) dst;
+    STATS (stats->output_bytes += *dst_size);
+
+    if (!enc->finished || enc->held_count)
+        return LZW_OK;
+
+    lzw_encoder_free (enc);
+    return LZW_DONE;
+}
+
+/* LZW compression function. Bytes (8-bit) are read and written through callbacks and the
+ * "maxbits" parameter specifies the maximum symbol size (9-16), which in turn determines
+ * the RAM requirement and, to a large extent, the level of compression achievable. A return
+ * value of EOF from the "src" callback terminates the compression process. A non-zero return
+ * value indicates one of the possible errors -- bad "maxbits" param, unsuitable workspace or
+ * failed malloc().
+ * There are contexts (void pointers) that are passed to the callbacks to easily facilitate
+ * multiple instances of the compression operation (but simple applications can ignore these).
+ * The "_ws" variant uses the provided workspace instead of malloc() (see lzw_encoder_init_ws()).
+ */
+
+static int compress_callbacks (lzw_encoder_t *enc, void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx)
+{
+    unsigned char inbuf [CHUNK_SIZE], outbuf [CHUNK_SIZE], *cp;
+    size_t in_count, in_index, in_bytes, out_bytes;
+    int c, res;
+
+    // gather up chunks of input from the "src" callback and pass the compressed output to "dst"
+
+    do {
+        for (in_count = 0; in_count < sizeof (inbuf) && (c = (*src)(srcctx)) != EOF; in_count++)
+            inbuf [in_count] = c;
+
+        for (in_index = 0; in_index < in_count; in_index += in_bytes) {
+            in_bytes = in_count - in_index;
+            out_bytes = sizeof (outbuf);
+            lzw_encoder_feed (enc, inbuf + in_index, &in_bytes, outbuf, &out_bytes);
+
+            for (cp = outbuf; cp < outbuf + out_bytes; cp++)
+                (*dst)(*cp, dstctx);
+        }
+
+    } while (in_count == sizeof (inbuf));
+
+    do {
+        out_bytes = sizeof (outbuf);
+        res = lzw_encoder_finish (enc, outbuf, &out_bytes);
+
+        for (cp = outbuf; cp < outbuf + out_bytes; cp++)
+            (*dst)(*cp, dstctx);
+
+    } while (res == LZW_OK);
+
+    return 0;
+}
+
+int lzw_compress_ws (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits, void *workspace, size_t workspace_size)
+{
+    lzw_encoder_t enc;
+
+    if (lzw_encoder_init_ws (&enc, maxbits, workspace, workspace_size))
+        return 1;
+
+    return compress_callbacks (&enc, dst, dstctx, src, srcctx);
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits)
+{
+    return lzw_compress_ws (dst, dstctx, src, srcctx, maxbits, NULL, 0);
+}
+
+#ifdef LZW_STATS
+
+int lzw_compress_stats (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx)
+{
+    lzw_encoder_t enc;
+
+    if (lzw_encoder_init (&enc, maxbits))
+        return 1;
+
+    lzw_encoder_stats (&enc, stats, event, event_ctx);
+    return compress_callbacks (&enc, dst, dstctx, src, srcctx);
+}
+
+#endif
+#endif
+
+/* Buffer-to-buffer version of lzw_compress(). The "src_size" bytes at "src" are compressed
+ * into "dst", which has room for "*dst_size" bytes. On success, zero is returned and the number
+ * of bytes actually written is stored in "*dst_size". A non-zero return value indicates a bad
+ * "maxbits" param, an unsuitable workspace, a failed malloc(), or that the output did not fit
+ * (which can be avoided by allocating lzw_compress_bound() bytes for the output).
+ */
+
+int lzw_compress_buffer_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, int maxbits, void *workspace, size_t workspace_size)
+{
+    size_t consumed = src_size, produced = *dst_size, tail_bytes;
+    lzw_encoder_t enc;
+
+    if (lzw_encoder_init_ws (&enc, maxbits, workspace, workspace_size))
+        return 1;
+
+    lzw_encoder_feed (&enc, src, &consumed, dst, &produced);
+    tail_bytes = *dst_size - produced;
+
+    if (consumed == src_size && lzw_encoder_finish (&enc, (unsigned char *) dst + produced, &tail_bytes) == LZW_DONE) {
+        *dst_size = produced + tail_bytes;
+        return 0;
+    }
+
+    lzw_encoder_free (&enc);
+    return 1;
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_compress_buffer (void *dst, size_t *dst_size, const void *src, size_t src_size, int maxbits)
+{
+    return lzw_compress_buffer_ws (dst, dst_size, src, src_size, maxbits, NULL, 0);
+}
+
+#endif
+
+/* Return the worst-case compressed size of "src_size" bytes using the specified "maxbits"
+ * (an invalid "maxbits" gives the bound for 16 bits). Every input byte generates at most one
+ * code of no more than "maxbits" bits, and there are always at least 64 codes between
+ * CLEAR_CODEs, so this is a real bound (even though actual inflation is limited to about 8%
+ * by the decaying-ratio check in the encoder). The two extra codes are for the END_CODE and
+ * the first CLEAR_CODE, and the extra bytes are for the header and final partial byte.
+ */
+
+size_t lzw_compress_bound (size_t src_size, int maxbits)
+{
+    size_t codes = src_size + src_size / 64 + 2;
+
+    if (maxbits < 9 || maxbits > 16)
+        maxbits = 16;
+
+    return codes + (codes / 8 + 1) * (maxbits - 8) + 2;
+}
+
+/* The decoding engine starts by reading the "maxbits" header byte from the stream and allocating
+ * the storage (so the dictionary pointer in the context is NULL until then). The "reverse_buffer"
+ * holds the current string, in reverse order, and "pending" is the number of bytes from it that
+ * have not been output yet.
+ */
+
+#define DECODER_HEADER  0       // waiting for the "maxbits" byte
+#define DECODER_CODES   1       // reading codes
+#define DECODER_DONE    2       // END_CODE received (but there may still be pending output)
+#define DECODER_ERROR   3       // bad "maxbits", failed malloc() or corrupt stream
+#define DECODER_ID      4       // reading the preset dictionary ID
+
+/* A preset dictionary holds an encoder and a decoder that have been "primed" with its content, and
+ * which are copied to start each stream. The encoder's pending prefix (the end of the content) is never
+ * sent, and instead becomes the start of the first string of the stream, so the decoder must drop the
+ * first "skip" bytes of that string. Of course the pending bits of the codes that were sent are dropped
+ * too, and the stream starts on a byte boundary (see lzw_dictionary_create()).
+ */
+
+struct lzw_dictionary {
+    unsigned int id, skip;
+    int maxbits;
+    lzw_encoder_t encoder;
+    lzw_decoder_t decoder;
+};
+
+/* Initialize a decoder context using the provided workspace (if "workspace" is NULL, then the storage
+ * is allocated with malloc() once "maxbits" is known). Nothing is checked or allocated until the first
+ * byte of the stream (which specifies "maxbits") is received, so this can't fail, but a return value
+ * is provided for symmetry with lzw_encoder_init_ws(). If the workspace turns out to be too small for
+ * the stream, then that's reported as an error from lzw_decoder_feed().
+ */
+
+int lzw_decoder_init_ws (lzw_decoder_t *dec, void *workspace, size_t workspace_size)
+{
+    memset (dec, 0, sizeof (lzw_decoder_t));
+    dec->workspace = workspace;
+    dec->workspace_size = workspace_size;
+    dec->maxcode = FIRST_STRING;
+    dec->next_string = FIRST_STRING - 1;
+    dec->prefix = CLEAR_CODE;
+    dec->status = DECODER_HEADER;
+    return 0;
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_decoder_init (lzw_decoder_t *dec)
+{
+    return lzw_decoder_init_ws (dec, NULL, 0);
+}
+
+#endif
+
+#ifdef LZW_STATS
+
+// attach a statistics structure and optional "event" callback to an initialized decoder context
+
+void lzw_decoder_stats (lzw_decoder_t *dec, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx)
+{
+    dec->stats = stats;
+    dec->event = event;
+    dec->event_ctx = event_ctx;
+}
+
+#endif
+
+static void decoder_free (lzw_decoder_t *dec)
+{
+#ifndef LZW_NO_MALLOC
+    if (dec->allocated)
+        free (dec->workspace);
+#endif
+    dec->dictionary = dec->workspace = NULL;
+    dec->reverse_buffer = NULL;
+    dec->referenced = NULL;
+}
+
+static int decoder_start (lzw_decoder_t *dec, unsigned int read_byte)
+{
+    decoder_entry_t *dictionary;
+    unsigned int i;
+
+    if (read_byte & ~(FLUSH_FLAG | PRESET_FLAG | 0x7))  //sanitize first byte
+        return 1;
+
+    dec->flushable = (read_byte & FLUSH_FLAG) != 0;
+
+    // based on the "maxbits" parameter, compute total codes and allocate storage (if required)
+
+    if (!dec->workspace) {
+#ifndef LZW_NO_MALLOC
+        dec->workspace = malloc (lzw_workspace_size ((read_byte & 0x7) + 9, LZW_DECODER));
+        dec->allocated = 1;
+#endif
+    }
+    else if (bad_workspace (dec->workspace, dec->workspace_size, (read_byte & 0x7) + 9, LZW_DECODER))
+        return 1;
+
+    if (!dec->workspace)    // check for malloc() failure
+        return 1;
+
+    dec->total_codes = 512 << (read_byte & 0x7);
+    dec->max_available_code = dec->total_codes - 2;
+    dec->dictionary = dictionary = dec->workspace;
+    dec->referenced = (unsigned long long *) (dictionary + dec->total_codes);
+    dec->reverse_buffer = (unsigned char *) (dec->referenced + dec->total_codes / 64);
+
+    // Note that to implement the dictionary entry recycling we have to keep track of how many
+    // longer strings are based on each string in the dictionary. This can be between 0 (no
+    // references) to 256 (every possible next byte), but unfortunately that's one more value
+    // than what can be stored in a byte. The solution is to have a single bit for each entry
+    // indicating any references (i.e., the code cannot be recycled) and an additional byte
+    // in the dictionary entry struct counting the "extra" references (beyond one).
+
+    for (i = 0; i < 256; ++i) {                 // these never change
+        dictionary [i].prefix = NULL_CODE;
+        dictionary [i].terminator = i;
+    }
+
+    return 0;
+}
+
+/* Start the dictionary from the decoder's preset (once we have the ID), returns non-zero if it's not the right one.
+ * Unless the dictionary is full, only the strings defined so far (and their "referenced" bits) are copied, because
+ * add_string() initializes an entry completely when it's defined.
+ */
+
+static int decoder_preset (lzw_decoder_t *dec)
+{
+    const lzw_decoder_t *primed;
+    unsigned int end_code;
+
+    if (!dec->preset || dec->preset->id != dec->preset_id || dec->preset->decoder.total_codes != dec->total_codes)
+        return 1;
+
+    primed = &dec->preset->decoder;
+    end_code = primed->dictionary_full ? primed->max_available_code + 1 : primed->next_string;
+    memcpy (dec->dictionary, primed->dictionary, end_code * sizeof (decoder_entry_t));
+    memcpy (dec->referenced, primed->referenced, ((end_code + 63) >> 6) * sizeof (unsigned long long));
+    dec->maxcode = primed->maxcode;
+    dec->next_string = primed->next_string;
+    dec->prefix = primed->prefix;
+    dec->dictionary_full = primed->dictionary_full;
+    dec->skip = dec->preset->skip;
+    return 0;
+}
+
+/* The "referenced" bitfield is stored in 64-bit words so that the search for the next unreferenced string
+ * (the next one to recycle) can check 64 strings at a time. Only the bits from FIRST_STRING to
+ * "max_available_code" are searched (the others are not necessarily initialized) and, just like the
+ * search in the encoder, it wraps around to FIRST_STRING and there's always at least one to find.
+ */
+
+#define REFERENCED(code) (referenced [(code) >> 6] & (1ULL << ((code) & 63)))
+#define SET_REFERENCED(code) (referenced [(code) >> 6] |= 1ULL << ((code) & 63))
+#define CLEAR_REFERENCED(code) (referenced [(code) >> 6] &= ~(1ULL << ((code) & 63)))
+
+static unsigned int next_unreferenced (const unsigned long long *referenced, unsigned int code, unsigned int max_available_code)
+{
+    unsigned int index, last = max_available_code >> 6;
+    unsigned long long word;
+
+    if (code > max_available_code)
+        code = FIRST_STRING;
+
+    index = code >> 6;
+    word = ~referenced [index] & (~0ULL << (code & 63));
+
+    while (1) {
+        if (index == last)
+            word &= ~0ULL >> (63 - (max_available_code & 63));
+
+        if (word)
+            return (index << 6) + LOWEST_BIT (word);
+
+        if (++index > last) {
+            index = FIRST_STRING >> 6;
+            word = ~referenced [index] & (~0ULL << (FIRST_STRING & 63));
+        }
+        else
+            word = ~referenced [index];
+    }
+}
+
+/* Add the string "prefix" + "terminator" to the dictionary at "*next_string" and then advance "*next_string"
+ * (and "*maxcode") to the entry that will be defined next. This is shared by both decoder kernels, and
+ * because it's inlined the compiler keeps the arguments in registers (and drops the code for the other phase).
+ */
+
+static FORCE_INLINE void add_string (decoder_entry_t *dictionary, unsigned long long *referenced, unsigned int prefix, unsigned int terminator,
+    unsigned int *next_stringp, unsigned int *maxcodep, unsigned int *dictionary_fullp, const unsigned int max_available_code, const unsigned int full)
+{
+    unsigned int next_string = *next_stringp;
+
+    // This should always execute (the conditional is to catch corruptions) and is where we add a new string to
+    // the dictionary, either at the end or elsewhere when we are "recycling" entries that were never referenced
+
+    if (next_string >= FIRST_STRING && next_string <= max_available_code + 1) {
+        if (REFERENCED (prefix))                                // increment reference count on prefix
+            dictionary [prefix].extra_references++;
+        else
+            SET_REFERENCED (prefix);
+
+        dictionary [next_string].prefix = prefix;               // now update the next dictionary entry with the new string
+        dictionary [next_string].terminator = terminator;       // (but we're always one behind, so it's not the string just sent)
+        dictionary [next_string].extra_references = 0;          // newly created string has not been referenced
+        CLEAR_REFERENCED (next_string);
+    }
+
+    // If the dictionary is not full yet, we bump the maxcode and next_string and check to see if the
+    // dictionary is now full. If it is we set the dictionary_full flag and set next_string back to the
+    // beginning of the dictionary strings to start recycling them. Note that then maxcode will remain
+    // two less than total_codes because every string entry is available for matching, and the actual
+    // maximum code is reserved for EOF.
+
+    if (!full) {
+        ++*maxcodep;
+
+        if (++next_string > max_available_code) {
+            *dictionary_fullp = 1;
+            --*maxcodep;
+        }
+    }
+
+    // If the dictionary is full we look for an entry to recycle starting at next_string (the one we
+    // created or recycled) plus one. We know there is one because at a minimum the string we just added
+    // has not been referenced). This also takes care of removing the entry to be recycled (which is
+    // possible/easy because no longer strings have been based on it).
+
+    if (full || *dictionary_fullp) {
+        next_string = next_unreferenced (referenced, next_string + 1, max_available_code);
+
+        if (dictionary [dictionary [next_string].prefix].extra_references)
+            dictionary [dictionary [next_string].prefix].extra_references--;
+        else
+            CLEAR_REFERENCED (dictionary [next_string].prefix);
+    }
+
+    *next_stringp = next_string;
+}
+
+/* The streaming decoder kernel (see DISPATCH()). This decodes from "*spp" up to "src_end" and stores
+ * the output at "*dstp" up to "dst_end" (both are advanced), and stops when the input is exhausted,
+ * the output is full (in which case the rest of the current string is left pending), or when the
+ * END_CODE has been received.
+ */
+
+static FORCE_INLINE int decode_codes (lzw_decoder_t *dec, const unsigned char **spp, const unsigned char *src_end,
+    unsigned char **dstp, unsigned char *dst_end, const unsigned int maxbits, const unsigned int full)
+{
+    const unsigned int total_codes = 1 << maxbits, max_available_code = total_codes - 2;
+    unsigned int maxcode = dec->maxcode, next_string = dec->next_string, prefix = dec->prefix, dictionary_full = full;
+    unsigned int bits = dec->bits, pending = dec->pending, skip = dec->skip, done = dec->status != DECODER_CODES;
+    unsigned long long shifter = dec->shifter;
+    unsigned long long *referenced = dec->referenced;
+    unsigned char *reverse_buffer = dec->reverse_buffer;
+    decoder_entry_t *dictionary = dec->dictionary;
+    const unsigned char *sp = *spp;
+    unsigned char *dst = *dstp;
+    int result = KERNEL_DONE;
+    STATS_ONLY (lzw_stats_t *stats = dec->stats;)
+
+    // This is the main loop where we read input symbols. The values range from 0 to the code value
+    // of the "next" string in the dictionary (although the actual "next" code cannot be used yet,
+    // and so we reserve that code for the END_CODE). Note that running out of input just means that
+    // we return to the caller for more (we don't know yet whether that's an error).
+
+    while (1) {
+        unsigned int code_bits, extras, code;
+
+        if (pending) {                      // first send any part of the last string that didn't fit
+            size_t count = dst_end - dst;
+
+            if (count > pending)
+                count = pending;
+
+            pending -= count;
+
+            while (count--)
+                *dst++ = reverse_buffer [pending + count];
+
+            if (pending)
+                break;
+        }
+
+        if (done)
+            break;
+
+        code_bits = CODE_BITS (MAXCODE);
+        extras = (2 << code_bits) - MAXCODE - 1;
+
+        // If we might not have the whole code we refill the shifter 7 or 8 bytes at a time, unless we're near
+        // the end of the input. Then we read bytes only as required, assuming first that the code will fit in
+        // the minimum number of bits, and if code >= extras we need another bit to calculate the real code
+        // (this is the "adjusted binary" part). Note that nothing is removed from the shifter until we have
+        // the complete code, which makes it easy to resume.
+
+        if (bits <= code_bits) {
+            if (src_end - sp >= 8)
+                REFILL_BITS ();
+            else {
+                while (bits < code_bits) {
+                    if (sp == src_end) {
+                        result = KERNEL_INPUT;
+                        goto need_input;
+                    }
+
+                    shifter |= *sp++ << bits;
+                    bits += 8;
+                }
+
+                if (bits == code_bits && (shifter & ((1 << code_bits) - 1)) >= extras) {
+                    if (sp == src_end) {
+                        result = KERNEL_INPUT;
+                        goto need_input;
+                    }
+
+                    shifter |= *sp++ << bits;
+                    bits += 8;
+                }
+            }
+        }
+
+        DECODE_CODE (code);
+        STATS (stats->codes++; stats->code_bits += code_bits);
+
+        if (code == MAXCODE) {              // sending the maximum code is reserved for the end of the file
+            if (dec->flushable && prefix != CLEAR_CODE && prefix != NULL_CODE) {
+                shifter >>= bits & 7;       // except that in a flushable stream, if there's a string pending it's
+                bits &= ~7;                 // a flush point, so we skip to the next byte and undo the "maxcode"
+                prefix = NULL_CODE;         // advance for the code before it, which doesn't define a string
+                if (!full) maxcode--;
+                continue;
+            }
+
+            dec->status = DECODER_DONE;
+            break;
+        }
+        else if (prefix == NULL_CODE && code == next_string) {
+            dec->status = DECODER_ERROR;    // (can't happen after a flush point because no string is pending)
+            break;
+        }
+        else if (code == CLEAR_CODE) {      // otherwise check for a CLEAR_CODE to start over early
+            STATS (stats->clear_codes++;
+                if (dec->event) dec->event (LZW_EVENT_CLEAR_CODE, stats, dec->event_ctx));
+            next_string = FIRST_STRING - 1;
+            maxcode = FIRST_STRING;
+            dictionary_full = 0;
+        }
+        else if (!full && prefix == CLEAR_CODE) {   // this only happens at the first symbol which is always sent
+            reverse_buffer [0] = code;      // literally and becomes our initial prefix
+            pending = 1;
+            next_string++;
+            maxcode++;
+        }
+        // Otherwise we have a valid prefix so we step through the string from end to beginning storing the
+        // bytes in the "reverse_buffer", and then we send them out in the proper order. One corner-case
+        // we have to handle here is that the string might be the same one that is actually being defined
+        // now (code == next_string), in which case it's the prefix string plus its own first byte (which
+        // we put at the beginning of the "reverse_buffer" so that it's sent last).
+        else {
+            unsigned int cti = (code == next_string) ? prefix : code;
+            unsigned char *rbp = reverse_buffer + (code == next_string), *rblimit = rbp + total_codes - 256, c;
+
+            do {
+                *rbp++ = dictionary [cti].terminator;
+                if (rbp == rblimit) {
+                    dec->status = DECODER_ERROR;
+                    break;
+                }
+            } while ((cti = dictionary [cti].prefix) != NULL_CODE);
+
+            if (dec->status == DECODER_ERROR)
+                break;
+
+            c = rbp [-1];   // the first byte in this string is the terminator for the last string, which is
+                            // the one that we'll create a new dictionary entry for this time
+
+            if (code == next_string)
+                reverse_buffer [0] = c;
+
+            pending = rbp - reverse_buffer;     // send string in corrected order (starting at the top of the loop)
+
+            if (prefix == NULL_CODE) {          // the first code after a flush point doesn't define a string, but
+                if (!full)                      // it does advance "maxcode" (just like the encoder, which had
+                    maxcode++;                  // nothing pending and so added a string for this code)
+            }
+            else
+#ifdef LZW_STATS
+            if (stats) {
+                unsigned int start = next_string, was_full = dictionary_full;
+
+                count_steps (&stats->lookups, &stats->lookup_steps, &stats->max_lookup_steps, pending - (code == next_string));
+                add_string (dictionary, referenced, prefix, c, &next_string, &maxcode, &dictionary_full, max_available_code, full);
+
+                if (dictionary_full)            // the recycling scan is from "start" to "next_string" (with wrap)
+                    count_steps (&stats->recycles, &stats->recycle_steps, &stats->max_recycle_steps,
+                        next_string > start ? next_string - start : next_string + max_available_code + 1 - FIRST_STRING - start);
+
+                if (dictionary_full && !was_full) {
+                    stats->dictionary_fulls++;
+
+                    if (dec->event)
+                        dec->event (LZW_EVENT_DICTIONARY_FULL, stats, dec->event_ctx);
+                }
             }
+            else
+#endif
+            add_string (dictionary, referenced, prefix, c, &next_string, &maxcode, &dictionary_full, max_available_code, full);
+        }
+
+        if (skip) {         // the first string after a preset dictionary starts with the end of its content
+            pending = pending > skip ? pending - skip : 0;
+            skip = 0;
         }
 
         prefix = code;      // the code we just received becomes the prefix for the next dictionary string entry
                             // (which we'll create once we find out the terminator)
+
+        if (dictionary_full != full) {      // the dictionary filled or was cleared, so switch kernels
+            result = KERNEL_PHASE;
+            break;
+        }
     }
 
-    free (dictionary); free (reverse_buffer); free (referenced);
-    return 0;
+need_input:
+    dec->maxcode = maxcode; dec->next_string = next_string; dec->prefix = prefix; dec->skip = skip;
+    dec->dictionary_full = dictionary_full; dec->shifter = shifter; dec->bits = bits; dec->pending = pending;
+
+    *spp = sp;
+    *dstp = dst;
+    return result;
+}
+
+static int decode_kernel (lzw_decoder_t *dec, const unsigned char **spp, const unsigned char *src_end, unsigned char **dstp, unsigned char *dst_end)
+{
+    DISPATCH (decode_codes, CODE_BITS (dec->total_codes), dec->dictionary_full, dec, spp, src_end, dstp, dst_end)
 }
+
+/* Decompress as much of the "src_size" bytes at "src" as possible, storing the output at "*dstp"
+ * (which is advanced) up to "dst_end". This stops when the input is exhausted, the output is full
+ * (in which case the rest of the current string is left pending), or when the END_CODE has been
+ * received. Input is only read as required (so nothing is read beyond the END_CODE), and the number
+ * of bytes consumed is returned.
+ */
+
+static size_t decode_bytes (lzw_decoder_t *dec, unsigned char **dstp, unsigned char *dst_end, const unsigned char *src, size_t src_size)
+{
+    const unsigned char *src_end = src + src_size, *sp = src;
+    int result;
+
+    if (dec->status == DECODER_HEADER) {
+        if (sp == src_end)
+            return 0;
+
+        if (decoder_start (dec, *sp)) {
+            dec->status = DECODER_ERROR;
+            return 1;
+        }
+
+        dec->status = (*sp++ & PRESET_FLAG) ? DECODER_ID : DECODER_CODES;
+    }
+
+    if (dec->status == DECODER_ID) {
+        while (dec->id_bytes < 4) {
+            if (sp == src_end)
+                return sp - src;
+
+            dec->preset_id |= (unsigned int) *sp++ << (dec->id_bytes++ * 8);
+        }
+
+        if (decoder_preset (dec)) {
+            dec->status = DECODER_ERROR;
+            return sp - src;
+        }
+
+        dec->status = DECODER_CODES;
+    }
+
+    if (dec->status == DECODER_ERROR)
+        return 0;
+
+    while ((result = decode_kernel (dec, &sp, src_end, dstp, dst_end)) == KERNEL_PHASE);
+
+    // If we stopped for any reason other than running out of input, there may be whole bytes in the
+    // shifter that were read ahead by a refill, so we give them back (they're still in the caller's
+    // buffer). This leaves exactly what reading byte by byte would have (because a refill is always
+    // followed by a code, after which fewer than 8 bits would be pending) and we never consume input
+    // past the END_CODE. If no code was read, the pending bits are from earlier calls and we keep them.
+
+    if (result != KERNEL_INPUT && dec->bits >= 8 && (size_t) (sp - src) >= (dec->bits >> 3)) {
+        sp -= dec->bits >> 3;
+        dec->bits &= 7;
+        dec->shifter &= (1 << dec->bits) - 1;
+    }
+
+    return sp - src;
+}
+
+/* Decompress the "*src_size" bytes of the compressed stream at "src" into the "*dst_size" bytes
+ * of space at "dst". On return, "*src_size" and "*dst_size" are set to the number of bytes actually
+ * consumed and generated. Not all of the input will be consumed if the output space is filled, or
+ * if the END_CODE is reached (we never read past that). This can be called with any amount of input
+ * or output space (including none, which is useful to get output that's pending from a long string).
+ * Returns LZW_DONE once the END_CODE has been received and all the output sent, LZW_ERROR for a bad
+ * "maxbits" in the stream (or one too large for the workspace), a failed malloc() or a corrupt
+ * stream, and otherwise LZW_OK.
+ */
+
+int lzw_decoder_feed (lzw_decoder_t *dec, const void *src, size_t *src_size, void *dst, size_t *dst_size)
+{
+    unsigned char *dp = dst;
+    STATS_ONLY (lzw_stats_t *stats = dec->stats;)
+
+    *src_size = decode_bytes (dec, &dp, dp + *dst_size, src, *src_size);
+    *dst_size = dp - (unsigned char *) dst;
+    STATS (stats->input_bytes += *src_size; stats->output_bytes += *dst_size);
+
+    if (dec->status == DECODER_ERROR)
+        return LZW_ERROR;
+
+    return (dec->status == DECODER_DONE && !dec->pending) ? LZW_DONE : LZW_OK;
+}
+
+/* Release the storage for a decoder context, which should be done when a stream is complete (or
+ * abandoned). Returns zero if the stream was complete (i.e., lzw_decoder_feed() returned LZW_DONE).
+ */
+
+int lzw_decoder_finish (lzw_decoder_t *dec)
+{
+    decoder_free (dec);
+    return dec->status != DECODER_DONE || dec->pending;
+}
+
+/* Decoder checkpoints. The decoder's state depends on everything before it in the stream, so to start
+ * decoding in the middle of a long stream we need a snapshot of that state, which is taken between strings
+ * (with no output pending) and stored in this portable format (multi-byte values are little-endian):
+ *
+ *   0  "LZWC"          4  version (1)          5  stream header byte (without the preset flag)
+ *   6  pending bits    7  their value          8  input offset (64-bit)      16  output offset (64-bit)
+ *  24  maxcode        26  next_string         28  prefix                     30  flags (1 = dictionary full)
+ *  31  reserved (0)   32  the prefix (16-bit) and terminator of each string from FIRST_STRING up to
+ *                         "max_available_code" (if full) or "next_string" - 1 (if not)
+ *
+ * The input offset is where decoding resumes (at a byte boundary, after the pending bits stored here)
+ * and the output offset is just carried along for the application. The reference counts used for
+ * recycling are not stored because they can be recounted from the prefixes of the strings (the strings
+ * based on the literals are counted too, but those are never recycled so it doesn't matter).
+ */
+
+#define CHECKPOINT_VERSION  1
+#define CHECKPOINT_FULL     1
+
+static void put_le (unsigned char *dst, unsigned long long value, int bytes)
+{
+    while (bytes--) {
+        *dst++ = (unsigned char) value;
+        value >>= 8;
+    }
+}
+
+static unsigned long long get_le (const unsigned char *src, int bytes)
+{
+    unsigned long long value = 0;
+
+    while (bytes--)
+        value = value << 8 | src [bytes];
+
+    return value;
+}
+
+// return the number of strings stored in a checkpoint with the given state
+
+static unsigned int checkpoint_strings (unsigned int total_codes, unsigned int next_string, unsigned int dictionary_full)
+{
+    if (dictionary_full)
+        return total_codes - 2 - FIRST_STRING + 1;
+
+    return next_string > FIRST_STRING ? next_string - FIRST_STRING : 0;
+}
+
+/* Return the maximum size of a checkpoint for a stream with the specified "maxbits" (9 to 16).
+ */
+
+size_t lzw_checkpoint_bound (int maxbits)
+{
+    if (maxbits < 9 || maxbits > 16)
+        maxbits = 16;
+
+    return LZW_CHECKPOINT_HEADER_SIZE + checkpoint_strings (1 << maxbits, 0, 1) * 3;
+}
+
+/* Store a checkpoint of the decoder's state into the "*dst_size" bytes at "dst" (and set "*dst_size"
+ * to its actual size). The caller provides "input_offset", the number of stream bytes consumed so far
+ * by lzw_decoder_feed() (counting from the header byte), and "output_offset", which is usually the
+ * number of bytes decoded so far. This can only be done between strings, which is always the case
+ * after lzw_decoder_feed() has run out of input rather than output space (and otherwise a call with
+ * no input will send what's pending). Returns non-zero if that's not the case, the decoder hasn't
+ * started (or has finished) or "*dst_size" is too small.
+ */
+
+int lzw_decoder_checkpoint (const lzw_decoder_t *dec, unsigned long long input_offset, unsigned long long output_offset, void *dst, size_t *dst_size)
+{
+    unsigned int strings, maxbits = 9, code;
+    const decoder_entry_t *dictionary = dec->dictionary;
+    unsigned char *dp = dst;
+
+    if (dec->status != DECODER_CODES || dec->pending || dec->skip || input_offset < (dec->bits >> 3))
+        return 1;
+
+    strings = checkpoint_strings (dec->total_codes, dec->next_string, dec->dictionary_full);
+
+    if (*dst_size < LZW_CHECKPOINT_HEADER_SIZE + strings * 3)
+        return 1;
+
+    while ((1U << maxbits) < dec->total_codes)
+        maxbits++;
+
+    memcpy (dp, LZW_CHECKPOINT_MAGIC, 4);
+    dp [4] = CHECKPOINT_VERSION;
+    dp [5] = (maxbits - 9) | (dec->flushable ? FLUSH_FLAG : 0);
+    dp [6] = dec->bits & 7;                             // whole bytes in the shifter are given back
+    dp [7] = (unsigned char) (dec->shifter & ((1 << (dec->bits & 7)) - 1));
+    put_le (dp + 8, input_offset - (dec->bits >> 3), 8);
+    put_le (dp + 16, output_offset, 8);
+    put_le (dp + 24, dec->maxcode, 2);
+    put_le (dp + 26, dec->next_string, 2);
+    put_le (dp + 28, dec->prefix, 2);
+    dp [30] = dec->dictionary_full ? CHECKPOINT_FULL : 0;
+    dp [31] = 0;
+    dp += LZW_CHECKPOINT_HEADER_SIZE;
+
+    for (code = FIRST_STRING; code < FIRST_STRING + strings; ++code) {
+        put_le (dp, dictionary [code].prefix, 2);
+        dp [2] = dictionary [code].terminator;
+        dp += 3;
+    }
+
+    *dst_size = dp - (unsigned char *) dst;
+    return 0;
+}
+
+/* Check the LZW_CHECKPOINT_HEADER_SIZE bytes at the start of a checkpoint, and return the size of the
+ * whole checkpoint (or zero if it's not valid). The offsets stored in it are returned if the pointers
+ * are not NULL. This allows a file of checkpoints to be indexed without reading all of each one.
+ */
+
+size_t lzw_checkpoint_info (const void *checkpoint, unsigned long long *input_offset, unsigned long long *output_offset)
+{
+    const unsigned char *cp = checkpoint;
+    unsigned int total_codes = 512 << (cp [5] & 0x7);
+    unsigned int next_string = (unsigned int) get_le (cp + 26, 2);
+
+    if (memcmp (cp, LZW_CHECKPOINT_MAGIC, 4) || cp [4] != CHECKPOINT_VERSION || (cp [5] & ~(FLUSH_FLAG | 0x7)) ||
+        cp [6] > 7 || (cp [7] >> cp [6]) || (cp [30] & ~CHECKPOINT_FULL) || cp [31] ||
+        next_string < FIRST_STRING - 1 || next_string > total_codes - 2)
+            return 0;
+
+    if (input_offset)
+        *input_offset = get_le (cp + 8, 8);
+
+    if (output_offset)
+        *output_offset = get_le (cp + 16, 8);
+
+    return LZW_CHECKPOINT_HEADER_SIZE + checkpoint_strings (total_codes, next_string, cp [30] & CHECKPOINT_FULL) * 3;
+}
+
+/* Restore a decoder from a checkpoint, after which the stream is fed to lzw_decoder_feed() starting at
+ * the checkpoint's input offset. The decoder must have been initialized (with any of the init functions,
+ * which decide how the storage is obtained) and not fed anything yet. Everything in the checkpoint is
+ * checked, so one that's corrupt (or doesn't fit the workspace) returns non-zero, as does a decoder
+ * that has already started. Of course a valid checkpoint from a different stream is not detected.
+ */
+
+int lzw_decoder_restore (lzw_decoder_t *dec, const void *checkpoint, size_t checkpoint_size)
+{
+    const unsigned char *cp = checkpoint, *sp = cp + LZW_CHECKPOINT_HEADER_SIZE;
+    unsigned int maxcode, next_string, prefix, full, strings, code;
+    unsigned long long *referenced;
+    decoder_entry_t *dictionary;
+
+    if (dec->status != DECODER_HEADER || checkpoint_size < LZW_CHECKPOINT_HEADER_SIZE ||
+        lzw_checkpoint_info (cp, NULL, NULL) != checkpoint_size)
+            return 1;
+
+    if (decoder_start (dec, cp [5])) {
+        dec->status = DECODER_ERROR;
+        return 1;
+    }
+
+    maxcode = (unsigned int) get_le (cp + 24, 2);
+    next_string = (unsigned int) get_le (cp + 26, 2);
+    prefix = (unsigned int) get_le (cp + 28, 2);
+    full = cp [30] & CHECKPOINT_FULL;
+    strings = checkpoint_strings (dec->total_codes, next_string, full);
+    dictionary = dec->dictionary;
+    referenced = dec->referenced;
+
+    // "maxcode" is one more than "next_string" until the dictionary fills (or equal right after a flush
+    // point), and the prefix has to be a code that's defined (or one of the special values)
+
+    if ((full ? maxcode != dec->total_codes - 1 || next_string < FIRST_STRING :
+            maxcode != next_string + 1 && (maxcode != next_string || prefix != NULL_CODE)) ||
+        (prefix != CLEAR_CODE && prefix != NULL_CODE && (prefix > dec->max_available_code || (!full && prefix >= next_string)))) {
+            dec->status = DECODER_ERROR;
+            return 1;
+    }
+
+    memset (referenced, 0, dec->total_codes / 8);
+
+    for (code = 0; code < dec->total_codes; ++code)
+        dictionary [code].extra_references = 0;
+
+    for (code = FIRST_STRING; code < FIRST_STRING + strings; ++code, sp += 3) {
+        unsigned int string_prefix = (unsigned int) get_le (sp, 2);
+
+        if (string_prefix == CLEAR_CODE || string_prefix > dec->max_available_code || (!full && string_prefix >= next_string)) {
+            dec->status = DECODER_ERROR;
+            return 1;
+        }
+
+        dictionary [code].prefix = string_prefix;
+        dictionary [code].terminator = sp [2];
+    }
+
+    // recount the references, except from the entry at "next_string" when the dictionary is full (which is
+    // the next to be recycled, and was removed from its prefix's count when it was picked)
+
+    for (code = FIRST_STRING; code < FIRST_STRING + strings; ++code)
+        if (!full || code != next_string) {
+            if (REFERENCED (dictionary [code].prefix))
+                dictionary [dictionary [code].prefix].extra_references++;
+            else
+                SET_REFERENCED (dictionary [code].prefix);
+        }
+
+    if (full && REFERENCED (next_string)) {     // the one to recycle next can't be referenced
+        dec->status = DECODER_ERROR;
+        return 1;
+    }
+
+    dec->maxcode = maxcode;
+    dec->next_string = next_string;
+    dec->prefix = prefix;
+    dec->dictionary_full = full;
+    dec->shifter = cp [7];
+    dec->bits = cp [6];
+    dec->status = DECODER_CODES;
+    return 0;
+}
+
+/* LZW decompression function. Bytes (8-bit) are read and written through callbacks. The
+ * "maxbits" parameter is read as the first byte in the stream and controls how much memory
+ * is allocated for decoding. A return value of EOF from the "src" callback terminates the
+ * decompression process (although this should not normally occur). A non-zero return value
+ * indicates an error, which in this case can be a bad "maxbits" read from the stream, a
+ * failed malloc(), or if an EOF is read from the input stream before the decompression
+ * terminates naturally with END_CODE. There are contexts (void pointers) that are passed
+ * to the callbacks to easily facilitate multiple instances of the decompression operation
+ * (but simple applications can ignore these). The "_ws" variant uses the provided workspace
+ * instead of malloc() (see lzw_decoder_init_ws()).
+ */
+
+static int decompress_callbacks (lzw_decoder_t *dec, void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx)
+{
+    unsigned char inbuf [4], outbuf [CHUNK_SIZE], *cp;
+    size_t in_count, out_bytes, need;
+    int c, res;
+
+    // Input bytes are passed to the decoder only as they are required to complete the next code, so that
+    // we never read past the END_CODE, but the output is sent in chunks. Note that we only need more input
+    // once everything pending has been sent.
+
+    do {
+        unsigned int code_bits = CODE_BITS (dec->maxcode);
+
+        if (dec->pending)
+            need = 0;
+        else if (dec->status == DECODER_CODES && dec->bits < code_bits)
+            need = (code_bits - dec->bits + 7) >> 3;
+        else
+            need = 1;
+
+        for (in_count = 0; in_count < need && (c = (*src)(srcctx)) != EOF; in_count++)
+            inbuf [in_count] = c;
+
+        out_bytes = sizeof (outbuf);
+        res = lzw_decoder_feed (dec, inbuf, &in_count, outbuf, &out_bytes);
+
+        for (cp = outbuf; cp < outbuf + out_bytes; cp++)
+            (*dst)(*cp, dstctx);
+
+    } while (res == LZW_OK && in_count == need);
+
+    return lzw_decoder_finish (dec);
+}
+
+int lzw_decompress_ws (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, void *workspace, size_t workspace_size)
+{
+    lzw_decoder_t dec;
+
+    lzw_decoder_init_ws (&dec, workspace, workspace_size);
+    return decompress_callbacks (&dec, dst, dstctx, src, srcctx);
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_decompress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx)
+{
+    return lzw_decompress_ws (dst, dstctx, src, srcctx, NULL, 0);
+}
+
+#ifdef LZW_STATS
+
+int lzw_decompress_stats (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx)
+{
+    lzw_decoder_t dec;
+
+    lzw_decoder_init (&dec);
+    lzw_decoder_stats (&dec, stats, event, event_ctx);
+    return decompress_callbacks (&dec, dst, dstctx, src, srcctx);
+}
+
+#endif
+#endif
+
+/* This is the decoder engine used when the entire output buffer is available (i.e., the buffer-to-buffer
+ * API). Because every string that we might need is still sitting in the output, we don't have to walk
+ * the prefix chains (backward) at all. Instead, we store the offset and length of each dictionary string
+ * as it is defined and simply copy it forward into the output. This also makes creating a new string
+ * trivial because it's always the previous string plus one byte, and the byte that follows the previous
+ * string in the output is the first byte of the current string. The prefixes (and terminators) are still
+ * maintained in the regular dictionary, because that's how we know which entries can be recycled.
+ *
+ * The strings are copied 8 bytes at a time (which will write past the end of the string) whenever there's
+ * room in the output for that. This works even when the source and destination are close together because
+ * the source string always ends at or before the destination, so any byte of the string that we read
+ * has not been touched by the copy.
+ *
+ * The workspace is the dictionary, followed by the offsets, the lengths and the "referenced" bitfield. The
+ * offsets are 32-bit, so the caller only uses this for outputs up to 4GB. Returns zero on success (and the
+ * output size in "*dst_size"), otherwise "*dst_size" is the number of bytes that were written.
+ */
+
+typedef struct {
+    const unsigned char *sp, *src_end;
+    unsigned char *dst, *dp, *dst_end;
+    decoder_entry_t *dictionary;
+    unsigned long long shifter;
+    unsigned int bits, maxcode, next_string, prefix, dictionary_full, prev_offset, prev_length;
+} buffer_decoder_t;
+
+static FORCE_INLINE int decode_buffer_codes (buffer_decoder_t *bd, const unsigned int maxbits, const unsigned int full)
+{
+    const unsigned int total_codes = 1 << maxbits, max_available_code = total_codes - 2;
+    unsigned int maxcode = bd->maxcode, next_string = bd->next_string, prefix = bd->prefix, dictionary_full = full;
+    unsigned int bits = bd->bits, prev_offset = bd->prev_offset, prev_length = bd->prev_length;
+    unsigned long long shifter = bd->shifter;
+    const unsigned char *src_end = bd->src_end, *sp = bd->sp;
+    unsigned char *dst = bd->dst, *dp = bd->dp, *dst_end = bd->dst_end;
+    decoder_entry_t *dictionary = bd->dictionary;
+    unsigned int *offsets = (unsigned int *) (dictionary + total_codes);
+    unsigned short *lengths = (unsigned short *) (offsets + total_codes);
+    unsigned long long *referenced = (unsigned long long *) (lengths + total_codes);
+    int result = KERNEL_ERROR;
+
+    while (1) {
+        unsigned int code_bits = CODE_BITS (MAXCODE), extras = (2 << code_bits) - MAXCODE - 1, code;
+
+        if (bits <= code_bits) {
+            if (src_end - sp >= 8)
+                REFILL_BITS ();
+            else {
+                while (bits < code_bits) {
+                    if (sp == src_end) {
+                        result = KERNEL_INPUT;      // ran out of input before END_CODE
+                        goto done;
+                    }
+
+                    shifter |= *sp++ << bits;
+                    bits += 8;
+                }
+
+                if (bits == code_bits && (shifter & ((1 << code_bits) - 1)) >= extras) {
+                    if (sp == src_end) {
+                        result = KERNEL_INPUT;
+                        goto done;
+                    }
+
+                    shifter |= *sp++ << bits;
+                    bits += 8;
+                }
+            }
+        }
+
+        DECODE_CODE (code);
+
+        if (code == MAXCODE) {          // END_CODE
+            result = KERNEL_DONE;
+            break;
+        }
+        else if (code == CLEAR_CODE) {
+            next_string = FIRST_STRING - 1;
+            maxcode = FIRST_STRING;
+            dictionary_full = 0;
+        }
+        else if (!full && prefix == CLEAR_CODE) {
+            if (dp == dst_end)
+                break;
+
+            prev_offset = (unsigned int) (dp - dst);
+            prev_length = 1;
+            *dp++ = code;
+            next_string++;
+            maxcode++;
+        }
+        else {
+            unsigned int offset, length;
+
+            // Get the position of the string to copy. Codes below 256 are just a single byte, and the code
+            // being defined right now (next_string) is the previous string plus its own first byte. The length
+            // limit is the same one that "rblimit" enforces in the other decoder (for valid streams, anyway;
+            // corrupt streams can generate different garbage because we don't follow the prefix chains).
+
+            if (code < 256) {
+                offset = 0;
+                length = 1;
+            }
+            else if (code == next_string) {
+                offset = prev_offset;
+                length = prev_length + 1;
+            }
+            else {
+                offset = offsets [code];
+                length = lengths [code];
+            }
+
+            if (length >= total_codes - 256 + (code == next_string))
+                break;
+
+            if (length > (size_t) (dst_end - dp)) {     // doesn't fit, so send what does and fail
+                if (code < 256)
+                    break;
+
+                memcpy (dp, dst + offset, dst_end - dp);
+                dp = dst_end;
+                break;
+            }
+
+            if (code < 256)
+                *dp = code;
+            else if (length + 7 <= (size_t) (dst_end - dp)) {
+                const unsigned char *cp = dst + offset;
+                unsigned char *op = dp, *op_end = dp + length - (code == next_string);
+                unsigned long long chunk;
+
+                do {                            // (the source can be less than 8 bytes back, so each chunk is
+                    memcpy (&chunk, cp, 8);     // loaded before it's stored, which memcpy() doesn't promise)
+                    memcpy (op, &chunk, 8);
+                    op += 8; cp += 8;
+                } while (op < op_end);
+
+                if (code == next_string)
+                    dp [length - 1] = *dp;
+            }
+            else {
+                memcpy (dp, dst + offset, length - (code == next_string));
+
+                if (code == next_string)
+                    dp [length - 1] = *dp;
+            }
+
+            // the new dictionary string is the previous string plus the first byte of this one, which directly
+            // follows it in the output (the index is checked here because add_string() might not add it)
+
+            if (next_string >= FIRST_STRING && next_string <= max_available_code) {
+                offsets [next_string] = prev_offset;
+                lengths [next_string] = prev_length + 1;
+            }
+
+            add_string (dictionary, referenced, prefix, *dp, &next_string, &maxcode, &dictionary_full, max_available_code, full);
+
+            prev_offset = (unsigned int) (dp - dst);
+            prev_length = length;
+            dp += length;
+        }
+
+        prefix = code;
+
+        if (dictionary_full != full) {  // the dictionary filled or was cleared, so switch kernels
+            result = KERNEL_PHASE;
+            break;
+        }
+    }
+
+done:
+    bd->maxcode = maxcode; bd->next_string = next_string; bd->prefix = prefix; bd->dictionary_full = dictionary_full;
+    bd->bits = bits; bd->prev_offset = prev_offset; bd->prev_length = prev_length; bd->shifter = shifter;
+    bd->sp = sp; bd->dp = dp;
+    return result;
+}
+
+static int decode_buffer_kernel (buffer_decoder_t *bd, unsigned int maxbits)
+{
+    DISPATCH (decode_buffer_codes, maxbits, bd->dictionary_full, bd)
+}
+
+static int decode_buffer (unsigned char *dst, size_t *dst_size, const unsigned char *src, size_t src_size, void *workspace)
+{
+    unsigned int maxbits = (*src & 0x7) + 9, i;         // header byte has already been checked by caller
+    buffer_decoder_t bd;
+    int result;
+
+    memset (&bd, 0, sizeof (bd));
+    bd.sp = src + 1; bd.src_end = src + src_size;
+    bd.dst = bd.dp = dst; bd.dst_end = dst + *dst_size;
+    bd.dictionary = workspace;
+    bd.maxcode = FIRST_STRING;
+    bd.next_string = FIRST_STRING - 1;
+    bd.prefix = CLEAR_CODE;
+
+    for (i = 0; i < 256; ++i) {                 // these never change
+        bd.dictionary [i].prefix = NULL_CODE;
+        bd.dictionary [i].terminator = i;
+    }
+
+    while ((result = decode_buffer_kernel (&bd, maxbits)) == KERNEL_PHASE);
+
+    *dst_size = bd.dp - dst;
+    return result != KERNEL_DONE;
+}
+
+/* Buffer-to-buffer version of lzw_decompress(). The complete compressed stream of "src_size" bytes
+ * at "src" is decompressed into "dst", which has room for "*dst_size" bytes. On success, zero is
+ * returned and the number of bytes actually written is stored in "*dst_size". A non-zero return
+ * value indicates a bad "maxbits" read from the stream (or one too large for the provided workspace),
+ * a failed malloc(), that the stream ended before the END_CODE, or that the output did not fit into
+ * "dst" (in which case "*dst_size" is set to the number of bytes that were written).
+ *
+ * If the workspace is large enough for LZW_BUFFER_DECODER (or is allocated here) and the output is no
+ * larger than 4GB, then the faster forward decoder is used, otherwise this uses the streaming decoder
+ * (which only needs LZW_DECODER size). The results are identical.
+ */
+
+int lzw_decompress_buffer_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, void *workspace, size_t workspace_size)
+{
+    const unsigned char *header = src;
+    lzw_decoder_t dec;
+
+    if (src_size && !(*header & 0xf8) && *dst_size <= 0xffffffffUL) {
+        int maxbits = (*header & 0x7) + 9;
+
+        if (!workspace) {
+#ifndef LZW_NO_MALLOC
+            void *buffer_workspace = malloc (lzw_workspace_size (maxbits, LZW_BUFFER_DECODER));
+
+            if (buffer_workspace) {
+                int result = decode_buffer (dst, dst_size, src, src_size, buffer_workspace);
+                free (buffer_workspace);
+                return result;
+            }
+#endif
+        }
+        else if (!bad_workspace (workspace, workspace_size, maxbits, LZW_BUFFER_DECODER))
+            return decode_buffer (dst, dst_size, src, src_size, workspace);
+    }
+
+    lzw_decoder_init_ws (&dec, workspace, workspace_size);
+    lzw_decoder_feed (&dec, src, &src_size, dst, dst_size);
+    return lzw_decoder_finish (&dec);
+}
+
+#ifndef LZW_NO_MALLOC
+
+int lzw_decompress_buffer (void *dst, size_t *dst_size, const void *src, size_t src_size)
+{
+    return lzw_decompress_buffer_ws (dst, dst_size, src, src_size, NULL, 0);
+}
+
+#endif
+
+#ifndef LZW_NO_MALLOC
+
+/* Create a preset dictionary from the "content_size" bytes at "content" (which isn't referenced once
+ * this returns) for streams with the specified "maxbits" and "id". The encoder is primed by compressing
+ * the content, and the decoder by decompressing the codes that it sent (with any pending bits padded to
+ * a byte, which can't be a complete code), which also checks that they agree. Returns NULL for a bad
+ * "maxbits" or a failed malloc(). Note that the content should be shorter than the number of codes for
+ * strings (1 << maxbits) - 257, which leaves room for a message's new strings (each byte adds at most one).
+ * Longer content fills the dictionary, so the start of it is recycled, and so is an entry for every new
+ * string in a message, which makes each message slower to compress than it is with no dictionary.
+ */
+
+lzw_dictionary_t *lzw_dictionary_create (const void *content, size_t content_size, int maxbits, unsigned int id)
+{
+    size_t stream_size = lzw_compress_bound (content_size, maxbits), consumed = content_size, produced = stream_size;
+    size_t decoded_size = content_size;
+    lzw_dictionary_t *dictionary = calloc (1, sizeof (lzw_dictionary_t));
+    unsigned char *stream = malloc (stream_size + 4), *decoded = malloc (content_size + 1);
+    lzw_encoder_t *enc;
+    lzw_decoder_t *dec;
+    int error = 1;
+
+    if (dictionary && stream && decoded && !lzw_encoder_init (&dictionary->encoder, maxbits)) {
+        enc = &dictionary->encoder;
+        dec = &dictionary->decoder;
+        lzw_encoder_feed (enc, content, &consumed, stream, &produced);
+
+        while (enc->bits) {
+            stream [produced++] = (unsigned char) enc->shifter;
+            enc->shifter >>= 8;
+            enc->bits = enc->bits > 8 ? enc->bits - 8 : 0;
+        }
+
+        lzw_decoder_init (dec);
+        consumed = (consumed == content_size) ? produced : 0;
+
+        if (consumed && lzw_decoder_feed (dec, stream, &consumed, decoded, &decoded_size) == LZW_OK &&
+            consumed == produced && !dec->pending && !memcmp (decoded, content, decoded_size)) {
+                dictionary->id = id;
+                dictionary->maxbits = maxbits;
+                dictionary->skip = (unsigned int) (content_size - decoded_size);
+                dec->shifter = dec->bits = 0;
+                error = 0;
+        }
+    }
+
+    free (decoded);
+    free (stream);
+
+    if (error && dictionary) {
+        lzw_dictionary_free (dictionary);
+        dictionary = NULL;
+    }
+
+    return dictionary;
+}
+
+/* Create a preset dictionary from the contents of a dictionary file (see lzwlib.h). Returns NULL
+ * if the file is not valid, or if lzw_dictionary_create() fails.
+ */
+
+lzw_dictionary_t *lzw_dictionary_load (const void *file_data, size_t file_size)
+{
+    const unsigned char *header = file_data;
+    size_t content_size;
+
+    if (file_size < LZW_DICTIONARY_HEADER_SIZE || memcmp (header, LZW_DICTIONARY_MAGIC, 4) ||
+        header [4] != 1 || header [5] < 9 || header [5] > 16 || header [6] || header [7])
+            return NULL;
+
+    content_size = header [12] | header [13] << 8 | header [14] << 16 | (size_t) header [15] << 24;
+
+    if (content_size > file_size - LZW_DICTIONARY_HEADER_SIZE)
+        return NULL;
+
+    return lzw_dictionary_create (header + LZW_DICTIONARY_HEADER_SIZE, content_size, header [5],
+        header [8] | header [9] << 8 | header [10] << 16 | (unsigned int) header [11] << 24);
+}
+
+void lzw_dictionary_free (lzw_dictionary_t *dictionary)
+{
+    lzw_encoder_free (&dictionary->encoder);
+    decoder_free (&dictionary->decoder);
+    free (dictionary);
+}
+
+/* Initialize an encoder context to start from a preset dictionary, using the provided workspace (or one
+ * allocated with malloc() if "workspace" is NULL) just like lzw_encoder_init_ws() for the dictionary's
+ * "maxbits". The primed encoder is copied into it, and the stream header gets the ID. Only the strings
+ * that are defined are copied (the encoder clears each new entry before using it), which for a dictionary
+ * that isn't full is much less than the whole workspace. If the workspace has a hash table, then the heads
+ * are copied (which is faster than clearing them and setting just the heads of those strings) along with
+ * the chain links, keys and leaf bits of those strings.
+ */
+
+int lzw_encoder_init_dict_ws (lzw_encoder_t *enc, const lzw_dictionary_t *dictionary, void *workspace, size_t workspace_size)
+{
+    const lzw_encoder_t *primed = &dictionary->encoder;
+    unsigned int total_codes = primed->total_codes, end_code, i;
+
+    if (encoder_init (enc, dictionary->maxbits, workspace, workspace_size, primed->hash_table))
+        return 1;
+
+    end_code = primed->dictionary_full ? primed->max_available_code + 1 : primed->next_string;
+    memcpy (enc->dictionary, primed->dictionary, end_code * sizeof (encoder_entry_t));
+
+    if (enc->hash_table) {
+        unsigned short *hash_next = enc->hash_table + total_codes * HASH_HEADS;
+        const unsigned short *primed_next = primed->hash_table + total_codes * HASH_HEADS;
+        unsigned int *keys = (unsigned int *) (hash_next + total_codes);
+
+        memcpy (hash_next + FIRST_STRING, primed_next + FIRST_STRING, (end_code - FIRST_STRING) * sizeof (unsigned short));
+        memcpy (keys + FIRST_STRING, (const unsigned int *) (primed_next + total_codes) + FIRST_STRING, (end_code - FIRST_STRING) * sizeof (unsigned int));
+        memcpy (LEAVES (enc->hash_table, total_codes), LEAVES (primed->hash_table, total_codes), ((end_code + 63) >> 6) * sizeof (unsigned long long));
+    }
+
+    enc->maxcode = primed->maxcode; enc->next_string = primed->next_string; enc->prefix = primed->prefix;
+    enc->dictionary_full = primed->dictionary_full; enc->available_entries = primed->available_entries;
+    enc->input_bytes = primed->input_bytes; enc->output_bytes = primed->output_bytes;
+
+    enc->held [0] |= PRESET_FLAG;
+
+    for (i = 0; i < 4; i++)
+        enc->held [enc->held_count++] = (unsigned char) (dictionary->id >> (i * 8));
+
+    return 0;
+}
+
+/* Initialize a decoder context that can decode streams using the specified preset dictionary (which
+ * is only copied if the stream actually has the dictionary's ID), with the workspace handled just like
+ * lzw_decoder_init_ws(). Streams without a preset dictionary are decoded normally, but a stream with a
+ * different ID is an error.
+ */
+
+int lzw_decoder_init_dict_ws (lzw_decoder_t *dec, const lzw_dictionary_t *dictionary, void *workspace, size_t workspace_size)
+{
+    lzw_decoder_init_ws (dec, workspace, workspace_size);
+    dec->preset = dictionary;
+    return 0;
+}
+
+int lzw_encoder_init_dict (lzw_encoder_t *enc, const lzw_dictionary_t *dictionary)
+{
+    return lzw_encoder_init_dict_ws (enc, dictionary, NULL, 0);
+}
+
+int lzw_decoder_init_dict (lzw_decoder_t *dec, const lzw_dictionary_t *dictionary)
+{
+    return lzw_decoder_init_dict_ws (dec, dictionary, NULL, 0);
+}
+
+/* Buffer-to-buffer versions of lzw_compress_buffer_ws() and lzw_decompress_buffer_ws() that use a preset
+ * dictionary (and the non-"_ws" versions allocate the workspace). To be sure the compressed data fits, allow
+ * lzw_compress_bound() plus the extra bytes LZW_DICTIONARY_OVERHEAD (the header is longer, and the encoder
+ * starts with a pending prefix).
+ */
+
+int lzw_compress_buffer_dict_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary,
+    void *workspace, size_t workspace_size)
+{
+    size_t consumed = src_size, produced = *dst_size, tail_bytes;
+    lzw_encoder_t enc;
+
+    if (lzw_encoder_init_dict_ws (&enc, dictionary, workspace, workspace_size))
+        return 1;
+
+    lzw_encoder_feed (&enc, src, &consumed, dst, &produced);
+    tail_bytes = *dst_size - produced;
+
+    if (consumed == src_size && lzw_encoder_finish (&enc, (unsigned char *) dst + produced, &tail_bytes) == LZW_DONE) {
+        *dst_size = produced + tail_bytes;
+        return 0;
+    }
+
+    lzw_encoder_free (&enc);
+    return 1;
+}
+
+int lzw_decompress_buffer_dict_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary,
+    void *workspace, size_t workspace_size)
+{
+    lzw_decoder_t dec;
+
+    lzw_decoder_init_dict_ws (&dec, dictionary, workspace, workspace_size);
+    lzw_decoder_feed (&dec, src, &src_size, dst, dst_size);
+    return lzw_decoder_finish (&dec);
+}
+
+int lzw_compress_buffer_dict (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary)
+{
+    return lzw_compress_buffer_dict_ws (dst, dst_size, src, src_size, dictionary, NULL, 0);
+}
+
+int lzw_decompress_buffer_dict (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary)
+{
+    return lzw_decompress_buffer_dict_ws (dst, dst_size, src, src_size, dictionary, NULL, 0);
+}
+
+#endif
@@ -9,7 +9,191 @@
 #ifndef LZWLIB_H_
 #define LZWLIB_H_
 
+#include <stddef.h>
+
+#ifndef LZW_NO_MALLOC
 int lzw_compress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits);
 int lzw_decompress (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx);
 
+int lzw_compress_buffer (void *dst, size_t *dst_size, const void *src, size_t src_size, int maxbits);
+int lzw_decompress_buffer (void *dst, size_t *dst_size, const void *src, size_t src_size);
+#endif
+
+size_t lzw_compress_bound (size_t src_size, int maxbits);
+
+// Caller-supplied workspace. Each "_ws" function takes a workspace of at least the size
+// returned by lzw_workspace_size() and aligned to LZW_WORKSPACE_ALIGN, and never calls malloc().
+// A decoder workspace must be sized for the largest "maxbits" the application will accept.
+// Defining LZW_NO_MALLOC removes the allocating functions (and the heap) altogether.
+
+#define LZW_ENCODER             0
+#define LZW_DECODER             1
+#define LZW_BUFFER_DECODER      2   // faster lzw_decompress_buffer_ws() (it falls back to LZW_DECODER size)
+#define LZW_HASH_ENCODER        3   // faster encoder (it falls back to LZW_ENCODER size)
+#define LZW_WORKSPACE_ALIGN     8
+
+size_t lzw_workspace_size (int maxbits, int mode);
+
+int lzw_compress_ws (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits, void *workspace, size_t workspace_size);
+int lzw_decompress_ws (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, void *workspace, size_t workspace_size);
+
+int lzw_compress_buffer_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, int maxbits, void *workspace, size_t workspace_size);
+int lzw_decompress_buffer_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, void *workspace, size_t workspace_size);
+
+// Optional statistics, only available when the library is built with LZW_STATS defined (otherwise
+// all the instrumentation compiles to nothing). The counts are only ever added to, so a structure
+// can accumulate over any number of streams (clear it first). For the decoder, "lookups" are the
+// strings decoded and "lookup_steps" their total length (the prefix chain walks), and the reset
+// causes are unknown (only "clear_codes" is counted). Note that the average number of bits per
+// code is "code_bits / codes", and the averages for lookups and recycles are similar. The byte
+// counts are updated once per call to the feed functions, so in events they're approximate.
+
+#ifdef LZW_STATS
+typedef struct {
+    unsigned long long input_bytes, output_bytes;       // (these include the stream's header byte)
+    unsigned long long codes, code_bits;                // codes sent or received (including CLEAR_CODE and END_CODE)
+    unsigned long long clear_codes;                     // all resets (CLEAR_CODE)
+    unsigned long long ratio_resets, floor_resets;      // encoder resets from the ratio check or too few recyclable entries
+    unsigned long long dictionary_fulls;                // times the dictionary was filled
+    unsigned long long lookups, lookup_steps;           // string searches, and total entries examined
+    unsigned long long recycles, recycle_steps;         // entries recycled, and total entries examined to find them
+    unsigned int max_lookup_steps, max_recycle_steps;
+} lzw_stats_t;
+
+#define LZW_EVENT_RATIO_RESET       1   // encoder sent CLEAR_CODE because the compression ratio got too poor
+#define LZW_EVENT_FLOOR_RESET       2   // encoder sent CLEAR_CODE because too few entries were recyclable
+#define LZW_EVENT_CLEAR_CODE        3   // decoder received CLEAR_CODE
+#define LZW_EVENT_DICTIONARY_FULL   4   // dictionary filled (recycling starts)
+
+typedef void (*lzw_event_fn) (int event, const lzw_stats_t *stats, void *ctx);
+#endif
+
+// Preset dictionaries (for compressing short messages). A dictionary is created from sample
+// "content" (which should be typical of the messages, with the most common strings last) by
+// running it through an encoder and a decoder once, so that every stream using it starts out
+// with the dictionary that content builds. These streams have a 4-byte "id" after the header
+// byte, and can only be decoded with the same dictionary. A dictionary is never modified once
+// created, so one can be shared between any number of threads.
+//
+// The file format written by lzwtrain (which lzw_dictionary_load() parses) is the 4-byte magic
+// "LZWD", a version byte (1), the "maxbits", two reserved bytes (zero), the "id" and the size of
+// the content (both little-endian 32-bit), and the content. The file isn't referenced once it's
+// loaded, because each process builds its own primed encoder and decoder from the content (about
+// the size of both workspaces), so only the file itself can be shared (e.g., memory-mapped).
+// Compressing "n" bytes with a dictionary can take LZW_DICTIONARY_OVERHEAD more bytes than
+// lzw_compress_bound (n).
+// The "_ws" functions take a workspace just like the others (sized for the dictionary's "maxbits").
+
+typedef struct lzw_dictionary lzw_dictionary_t;
+
+#define LZW_DICTIONARY_MAGIC        "LZWD"
+#define LZW_DICTIONARY_HEADER_SIZE  16
+#define LZW_DICTIONARY_OVERHEAD     8
+
+// Streaming (resumable) contexts. The contents are private and are only declared
+// here so that applications can allocate them (see lzwlib.c for the details).
+
+typedef struct {
+    void *dictionary;
+    unsigned short *hash_table;
+    unsigned int maxcode, next_string, prefix, total_codes;
+    unsigned int dictionary_full, available_entries, max_available_entries, max_available_code;
+    unsigned int input_bytes, output_bytes;
+    unsigned int shifter, bits;
+    unsigned int held_index, held_count, finished, allocated, started, flushable;
+    unsigned char held [16];
+#ifdef LZW_STATS
+    lzw_stats_t *stats;
+    lzw_event_fn event;
+    void *event_ctx;
+#endif
+} lzw_encoder_t;
+
+typedef struct {
+    void *dictionary, *workspace;
+    unsigned long long *referenced;
+    unsigned char *reverse_buffer;
+    size_t workspace_size;
+    unsigned int maxcode, next_string, prefix, total_codes;
+    unsigned int dictionary_full, max_available_code;
+    unsigned long long shifter;
+    unsigned int bits, pending;
+    const lzw_dictionary_t *preset;
+    unsigned int preset_id, id_bytes, skip, flushable;
+    int status, allocated;
+#ifdef LZW_STATS
+    lzw_stats_t *stats;
+    lzw_event_fn event;
+    void *event_ctx;
+#endif
+} lzw_decoder_t;
+
+#define LZW_OK      0       // returned by the streaming functions when more input (or output space) is needed
+#define LZW_DONE    1       // stream is complete (encoder finished, or decoder received END_CODE and sent everything)
+#define LZW_ERROR   (-1)    // bad "maxbits", unsuitable workspace, failed malloc() or corrupt stream
+
+#ifndef LZW_NO_MALLOC
+int lzw_encoder_init (lzw_encoder_t *enc, int maxbits);
+int lzw_decoder_init (lzw_decoder_t *dec);
+#endif
+
+int lzw_encoder_init_ws (lzw_encoder_t *enc, int maxbits, void *workspace, size_t workspace_size);
+int lzw_encoder_feed (lzw_encoder_t *enc, const void *src, size_t *src_size, void *dst, size_t *dst_size);
+int lzw_encoder_finish (lzw_encoder_t *enc, void *dst, size_t *dst_size);
+int lzw_encoder_allow_flush (lzw_encoder_t *enc);
+int lzw_encoder_flush (lzw_encoder_t *enc, void *dst, size_t *dst_size);
+void lzw_encoder_free (lzw_encoder_t *enc);
+
+int lzw_decoder_init_ws (lzw_decoder_t *dec, void *workspace, size_t workspace_size);
+int lzw_decoder_feed (lzw_decoder_t *dec, const void *src, size_t *src_size, void *dst, size_t *dst_size);
+int lzw_decoder_finish (lzw_decoder_t *dec);
+
+#ifndef LZW_NO_MALLOC
+lzw_dictionary_t *lzw_dictionary_create (const void *content, size_t content_size, int maxbits, unsigned int id);
+lzw_dictionary_t *lzw_dictionary_load (const void *file_data, size_t file_size);
+void lzw_dictionary_free (lzw_dictionary_t *dictionary);
+
+int lzw_encoder_init_dict (lzw_encoder_t *enc, const lzw_dictionary_t *dictionary);
+int lzw_decoder_init_dict (lzw_decoder_t *dec, const lzw_dictionary_t *dictionary);
+
+int lzw_compress_buffer_dict (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary);
+int lzw_decompress_buffer_dict (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary);
+
+int lzw_encoder_init_dict_ws (lzw_encoder_t *enc, const lzw_dictionary_t *dictionary, void *workspace, size_t workspace_size);
+int lzw_decoder_init_dict_ws (lzw_decoder_t *dec, const lzw_dictionary_t *dictionary, void *workspace, size_t workspace_size);
+
+int lzw_compress_buffer_dict_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary,
+    void *workspace, size_t workspace_size);
+int lzw_decompress_buffer_dict_ws (void *dst, size_t *dst_size, const void *src, size_t src_size, const lzw_dictionary_t *dictionary,
+    void *workspace, size_t workspace_size);
+#endif
+
+// Decoder checkpoints (for resuming in the middle of a long stream). A checkpoint is a portable
+// snapshot of the decoder's state (mostly its dictionary, 3 bytes per string) plus the offset in
+// the stream where decoding resumes and an output offset for the application. Taking one doesn't
+// change the stream or the decoder, and restoring one into a fresh decoder (which can be one with
+// a caller-supplied workspace) lets it continue from that offset. The format is described in
+// lzwlib.c, and lzw_checkpoint_info() reads the offsets and total size from the header.
+
+#define LZW_CHECKPOINT_MAGIC        "LZWC"
+#define LZW_CHECKPOINT_HEADER_SIZE  32
+
+size_t lzw_checkpoint_bound (int maxbits);
+int lzw_decoder_checkpoint (const lzw_decoder_t *dec, unsigned long long input_offset, unsigned long long output_offset, void *dst, size_t *dst_size);
+size_t lzw_checkpoint_info (const void *checkpoint, unsigned long long *input_offset, unsigned long long *output_offset);
+int lzw_decoder_restore (lzw_decoder_t *dec, const void *checkpoint, size_t checkpoint_size);
+
+// Attach statistics (and an optional event callback) to an initialized context, or use the
+// "_stats" variants of the callback functions (which otherwise work like the regular ones).
+
+#ifdef LZW_STATS
+void lzw_encoder_stats (lzw_encoder_t *enc, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx);
+void lzw_decoder_stats (lzw_decoder_t *dec, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx);
+
+#ifndef LZW_NO_MALLOC
+int lzw_compress_stats (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, int maxbits, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx);
+int lzw_decompress_stats (void (*dst)(int,void*), void *dstctx, int (*src)(void*), void *srcctx, lzw_stats_t *stats, lzw_event_fn event, void *event_ctx);
+#endif
+#endif
+
 #endif /* LZWLIB_H_ */
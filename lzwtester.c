@@ -14,9 +14,12 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <sys/mman.h>
 #endif
 
 #include "lzwlib.h"
+#include "lzwthread.h"
 
 /* This module provides a command-line test harness for the lzw library.
  * Given a list of files, it will read each one and byte-for-byte verify
@@ -27,7 +30,14 @@
  * compressed bitstream. Obviously this will introduce integrity failures,
  * but it should not cause a crash. It also has an "exhaustive" mode that
  * creates hundreds of simulated images from each input file by successive
- * truncation from both ends.
+ * truncation from both ends. Except on Windows, the files are memory-mapped
+ * rather than read into memory. The tests can be run on multiple threads
+ * (-j), and the results are identical (and in the same order) either way.
+ *
+ * Files over 1 GB (or all files with -s) are streamed instead, a chunk at a
+ * time, through the encoder and the decoder and compared with the original,
+ * so they can be any size and the memory used is bounded (a few MB per job).
+ * Only the round trip is checked that way (not the buffer functions).
  */
 
 static const char *usage =
@@ -36,12 +46,16 @@ static const char *usage =
 "            -0        = cycle through all maximum symbol sizes (default)\n"
 "            -e        = exhaustive test (by successive truncation)\n"
 "            -f        = fuzz test (randomly corrupt compressed data)\n"
+"            -j<n>     = run the tests on n threads (default 1)\n"
+"            -s        = stream all files (otherwise only those over 1 GB)\n"
 "            -q        = quiet mode (only reports errors and summary)\n\n"
 " Web:       Visit www.github.com/dbry/lzw-ab for latest version and info\n\n";
 
 typedef struct {
-    unsigned int size, index, wrapped, byte_errors, first_error, fuzz_testing;
+    unsigned long long size, index, wrapped, byte_errors, first_error;
+    unsigned long long kernel;          // fuzzing PRNG
     unsigned char *buffer;
+    int fuzz_testing;
 } streamer;
 
 static int read_buff (void *ctx)
@@ -54,21 +68,26 @@ static int read_buff (void *ctx)
     return stream->buffer [stream->index++];
 }
 
-static void write_buff (int value, void *ctx)
+// for fuzz testing, randomly corrupt 1 byte in every 65536 (on average)
+
+static int fuzz_byte (streamer *stream, int value)
 {
-    streamer *stream = ctx;
+    stream->kernel = ((stream->kernel << 4) - stream->kernel) ^ 1;
+    stream->kernel = ((stream->kernel << 4) - stream->kernel) ^ 1;
+    stream->kernel = ((stream->kernel << 4) - stream->kernel) ^ 1;
 
-    // for fuzz testing, randomly corrupt 1 byte in every 65536 (on average)
+    if (!(stream->kernel >> 48))
+        value ^= (int)(stream->kernel >> 40);
 
-    if (stream->fuzz_testing) {
-        static unsigned long long kernel = 0x3141592653589793;
-        kernel = ((kernel << 4) - kernel) ^ 1;
-        kernel = ((kernel << 4) - kernel) ^ 1;
-        kernel = ((kernel << 4) - kernel) ^ 1;
+    return value;
+}
 
-        if (!(kernel >> 48))
-            value ^= (int)(kernel >> 40);
-    }
+static void write_buff (int value, void *ctx)
+{
+    streamer *stream = ctx;
+
+    if (stream->fuzz_testing)
+        value = fuzz_byte (stream, value);
 
     if (stream->index == stream->size) {
         stream->index = 0;
@@ -94,6 +113,278 @@ static void check_buff (int value, void *ctx)
     stream->index++;
 }
 
+/* Repeat the buffer-to-buffer operations with caller-supplied workspaces that are exactly the
+ * required size, and make sure that a decoder workspace one byte too small is rejected. The
+ * workspaces are allocated here only for convenience; any suitably aligned memory works. Note
+ * that the decoder workspace is too small for LZW_BUFFER_DECODER, so this also verifies that
+ * the streaming decoder matches the forward decoder used by lzw_decompress_buffer().
+ */
+
+static int workspace_test (const unsigned char *data, size_t data_size, const unsigned char *stream, size_t stream_size, int maxbits, unsigned char *check)
+{
+    size_t encoder_size = lzw_workspace_size (maxbits, LZW_ENCODER), decoder_size = lzw_workspace_size (maxbits, LZW_DECODER);
+    void *workspace = malloc (encoder_size > decoder_size ? encoder_size : decoder_size);
+    unsigned char *output = malloc (stream_size);
+    size_t output_size = stream_size, check_size = data_size;
+    int error = 1;
+
+    if (workspace && output &&
+        !lzw_compress_buffer_ws (output, &output_size, data, data_size, maxbits, workspace, encoder_size) &&
+        output_size == stream_size && !memcmp (output, stream, stream_size) &&
+        !lzw_decompress_buffer_ws (check, &check_size, stream, stream_size, workspace, decoder_size) &&
+        check_size == data_size && !memcmp (check, data, data_size)) {
+            check_size = data_size;
+            error = !lzw_decompress_buffer_ws (check, &check_size, stream, stream_size, workspace, decoder_size - 1);
+    }
+
+    free (workspace);
+    free (output);
+    return error;
+}
+
+// Compress and decompress the data with a preset dictionary made from (up to) its first 4K, and make
+// sure that the stream can't be decoded without the dictionary.
+
+static int dictionary_test (const unsigned char *data, size_t data_size, int maxbits, unsigned char *check)
+{
+    lzw_dictionary_t *dictionary = lzw_dictionary_create (data, data_size < 4096 ? data_size : 4096, maxbits, 0x12345678);
+    size_t output_size = lzw_compress_bound (data_size, maxbits) + LZW_DICTIONARY_OVERHEAD, check_size = data_size;
+    unsigned char *output = malloc (output_size);
+    int error = 1;
+
+    if (dictionary && output &&
+        !lzw_compress_buffer_dict (output, &output_size, data, data_size, dictionary) &&
+        !lzw_decompress_buffer_dict (check, &check_size, output, output_size, dictionary) &&
+        check_size == data_size && !memcmp (check, data, data_size)) {
+            check_size = data_size;
+            error = !lzw_decompress_buffer (check, &check_size, output, output_size);
+    }
+
+    if (dictionary)
+        lzw_dictionary_free (dictionary);
+
+    free (output);
+    return error;
+}
+
+// Compress and then decompress the data using the streaming functions, providing input and output
+// space in small pseudo-random amounts (including none), and verify the stream and the data. This
+// exercises stopping and resuming the engines at every possible point.
+
+static int stream_test (const unsigned char *data, size_t data_size, const unsigned char *stream, size_t stream_size, int maxbits)
+{
+    unsigned long long kernel = 0x3141592653589793;
+    size_t in_index = 0, out_index = 0, in_bytes, out_bytes;
+    unsigned char buffer [256];
+    lzw_encoder_t enc;
+    lzw_decoder_t dec;
+    int res;
+
+    if (lzw_encoder_init (&enc, maxbits))
+        return 1;
+
+    do {
+        kernel = ((kernel << 4) - kernel) ^ 1;
+        in_bytes = (kernel >> 40) % 701;
+        out_bytes = (kernel >> 52) % sizeof (buffer);
+
+        if (in_index < data_size) {
+            if (in_bytes > data_size - in_index)
+                in_bytes = data_size - in_index;
+
+            res = lzw_encoder_feed (&enc, data + in_index, &in_bytes, buffer, &out_bytes);
+            in_index += in_bytes;
+        }
+        else
+            res = lzw_encoder_finish (&enc, buffer, &out_bytes);
+
+        if (res == LZW_ERROR || out_bytes > stream_size - out_index || memcmp (buffer, stream + out_index, out_bytes)) {
+            lzw_encoder_free (&enc);
+            return 1;
+        }
+
+        out_index += out_bytes;
+
+    } while (res != LZW_DONE);
+
+    if (out_index != stream_size)
+        return 1;
+
+    lzw_decoder_init (&dec);
+    in_index = out_index = 0;
+
+    do {
+        kernel = ((kernel << 4) - kernel) ^ 1;
+        in_bytes = (kernel >> 40) % 301;
+        out_bytes = (kernel >> 52) % sizeof (buffer);
+
+        if (in_bytes > stream_size - in_index)
+            in_bytes = stream_size - in_index;
+
+        res = lzw_decoder_feed (&dec, stream + in_index, &in_bytes, buffer, &out_bytes);
+        in_index += in_bytes;
+
+        if (res == LZW_ERROR || out_bytes > data_size - out_index || memcmp (buffer, data + out_index, out_bytes))
+            break;
+
+        out_index += out_bytes;
+
+    } while (res == LZW_OK);
+
+    return lzw_decoder_finish (&dec) || in_index != stream_size || out_index != data_size;
+}
+
+// Compress the data with flush points at pseudo-random intervals, and after each one make sure that the
+// stream so far decodes to exactly the data so far. Then verify that the whole stream decodes with both
+// the streaming and buffer functions.
+
+static int flush_test (const unsigned char *data, size_t data_size, int maxbits, unsigned char *check)
+{
+    size_t output_size = lzw_compress_bound (data_size, maxbits) + (data_size / 256 + 1) * 8;
+    size_t in_index = 0, out_index = 0, dec_index = 0, check_index = 0, in_bytes, out_bytes, check_bytes;
+    unsigned long long kernel = 0x2718281828459045;
+    unsigned char *output = malloc (output_size);
+    lzw_encoder_t enc;
+    lzw_decoder_t dec;
+    int error = 1;
+
+    if (!output || lzw_encoder_init (&enc, maxbits)) {
+        free (output);
+        return 1;
+    }
+
+    lzw_decoder_init (&dec);
+
+    if (lzw_encoder_allow_flush (&enc))
+        goto done;
+
+    while (in_index < data_size) {
+        kernel = ((kernel << 4) - kernel) ^ 1;
+        in_bytes = 256 + (kernel >> 40) % 4096;
+
+        if (in_bytes > data_size - in_index)
+            in_bytes = data_size - in_index;
+
+        out_bytes = output_size - out_index;
+
+        if (lzw_encoder_feed (&enc, data + in_index, &in_bytes, output + out_index, &out_bytes) == LZW_ERROR)
+            goto done;
+
+        in_index += in_bytes;
+        out_index += out_bytes;
+        out_bytes = output_size - out_index;
+
+        if (lzw_encoder_flush (&enc, output + out_index, &out_bytes) != LZW_DONE)
+            goto done;
+
+        out_index += out_bytes;
+        in_bytes = out_index - dec_index;
+        check_bytes = data_size - check_index;
+
+        if (lzw_decoder_feed (&dec, output + dec_index, &in_bytes, check + check_index, &check_bytes) != LZW_OK)
+            goto done;
+
+        dec_index += in_bytes;
+        check_index += check_bytes;
+
+        if (check_index != in_index || memcmp (check, data, check_index))
+            goto done;
+    }
+
+    out_bytes = output_size - out_index;
+
+    if (lzw_encoder_finish (&enc, output + out_index, &out_bytes) != LZW_DONE)
+        goto done;
+
+    out_index += out_bytes;
+    in_bytes = out_index - dec_index;
+    check_bytes = data_size - check_index;
+
+    if (lzw_decoder_feed (&dec, output + dec_index, &in_bytes, check + check_index, &check_bytes) == LZW_DONE &&
+        check_index + check_bytes == data_size && !memcmp (check, data, data_size)) {
+            check_bytes = data_size;
+            error = lzw_decompress_buffer (check, &check_bytes, output, out_index) ||
+                check_bytes != data_size || memcmp (check, data, data_size);
+    }
+
+done:
+    lzw_encoder_free (&enc);
+    lzw_decoder_finish (&dec);
+    free (output);
+    return error;
+}
+
+// Decode the stream, taking checkpoints of the decoder at about one third and two thirds of the way
+// through, and then make sure that decoding from each checkpoint gives the rest of the data.
+
+static int checkpoint_test (const unsigned char *data, size_t data_size, const unsigned char *stream, size_t stream_size, int maxbits, unsigned char *check)
+{
+    size_t checkpoint_bound = lzw_checkpoint_bound (maxbits), checkpoint_sizes [2], in_index = 0, out_index = 0, in_bytes, out_bytes;
+    unsigned char *checkpoints [2] = { malloc (checkpoint_bound), malloc (checkpoint_bound) };
+    unsigned long long kernel = 0x1414213562373095;
+    int taken = 0, error = 1, res, i;
+    lzw_decoder_t dec;
+
+    if (!checkpoints [0] || !checkpoints [1] || lzw_decoder_init (&dec)) {
+        free (checkpoints [0]);
+        free (checkpoints [1]);
+        return 1;
+    }
+
+    do {
+        kernel = ((kernel << 4) - kernel) ^ 1;
+        in_bytes = (kernel >> 40) % 1000 + 1;     // (never 0, which would end the loop early)
+
+        if (in_bytes > stream_size - in_index)
+            in_bytes = stream_size - in_index;
+
+        out_bytes = data_size - out_index;
+        res = lzw_decoder_feed (&dec, stream + in_index, &in_bytes, check + out_index, &out_bytes);
+        in_index += in_bytes;
+        out_index += out_bytes;
+
+        while (taken < 2 && out_index >= data_size / 3 * (taken + 1)) {
+            checkpoint_sizes [taken] = checkpoint_bound;
+
+            if (lzw_decoder_checkpoint (&dec, in_index, out_index, checkpoints [taken], &checkpoint_sizes [taken]))
+                break;
+
+            taken++;
+        }
+
+    } while (res == LZW_OK && (in_bytes || out_bytes));
+
+    if (lzw_decoder_finish (&dec) || res != LZW_DONE)
+        taken = 0;
+
+    for (i = 0; i < taken; ++i) {
+        unsigned long long input_offset, output_offset;
+
+        if (lzw_checkpoint_info (checkpoints [i], &input_offset, &output_offset) != checkpoint_sizes [i] ||
+            input_offset > stream_size || output_offset > data_size || lzw_decoder_init (&dec))
+                break;
+
+        in_bytes = stream_size - (size_t) input_offset;
+        out_bytes = data_size - (size_t) output_offset;
+
+        res = lzw_decoder_restore (&dec, checkpoints [i], checkpoint_sizes [i]) ? LZW_ERROR :
+            lzw_decoder_feed (&dec, stream + input_offset, &in_bytes, check, &out_bytes);
+
+        if (lzw_decoder_finish (&dec) || res != LZW_DONE || out_bytes != data_size - output_offset ||
+            memcmp (check, data + output_offset, out_bytes))
+                break;
+    }
+
+    // (a short stream might be decoded in too few calls to reach the thresholds, so fewer checkpoints are fine)
+
+    if (i == taken && (taken == 2 || stream_size < 4096))
+        error = 0;
+
+    free (checkpoints [0]);
+    free (checkpoints [1]);
+    return error;
+}
+
 #ifdef _WIN32
 
 long long DoGetFileSize (FILE *hFile)
@@ -130,16 +421,598 @@ long long DoGetFileSize (FILE *hFile)
 
 #endif
 
-int main (int argc, char **argv)
+/* Get the contents of the open file "infile" (which is closed). Except on Windows, the file is memory-mapped
+ * (and we fall back to reading it if that fails), so "*mapped" is set to indicate how to release it.
+ */
+
+static unsigned char *load_file (FILE *infile, size_t file_size, int *mapped)
+{
+    unsigned char *file_buffer;
+
+#ifndef _WIN32
+    void *mapping = mmap (NULL, file_size, PROT_READ, MAP_PRIVATE, fileno (infile), 0);
+
+    if (mapping != MAP_FAILED) {
+        madvise (mapping, file_size, MADV_WILLNEED);    // we go through it many times
+        fclose (infile);
+        *mapped = 1;
+        return mapping;
+    }
+#endif
+
+    *mapped = 0;
+    file_buffer = malloc (file_size);
+
+    if (file_buffer && fread (file_buffer, 1, file_size, infile) != file_size) {
+        free (file_buffer);
+        file_buffer = NULL;
+    }
+
+    fclose (infile);
+    return file_buffer;
+}
+
+static void release_file (unsigned char *file_buffer, size_t file_size, int mapped)
+{
+#ifndef _WIN32
+    if (mapped) {
+        munmap (file_buffer, file_size);
+        return;
+    }
+#endif
+    (void) file_size; (void) mapped;
+    free (file_buffer);
+}
+
+/* The tests are split into jobs (one for each maxbits of each truncation of each file) which are run in
+ * batches: jobs are generated for as many files as fit (see MAX_BATCH_JOBS and MAX_BATCH_BYTES), and then
+ * they're run and reported in order. With -j the jobs of a batch run on that many threads, each taking the
+ * next job as soon as it's done with the last (so they all stay busy even though jobs vary greatly in size),
+ * while the main thread reports the results as they become available. Every job has its own streamers and
+ * fuzzing PRNG (seeded from its size and maxbits), so the results don't depend on the number of threads
+ * or on which thread runs what.
+ */
+
+#define MAX_THREADS         64
+#define MAX_BATCH_JOBS      4096
+#define MAX_BATCH_BYTES     (256LL * 1024 * 1024)
+
+typedef struct {
+    const char *filename;
+    unsigned char *data;                                // (NULL for streamed jobs, which read the file from "offset")
+    unsigned long long offset, size, output_size;
+    int maxbits, fuzz_testing, quiet_mode, first;       // "first" is set for the first job of each file
+    int compress_error, inflation, no_memory, read_error, res, buffer_error, done;
+    streamer checker;                                   // (as left by the decompression)
+} job_t;
+
+typedef struct {
+    job_t *jobs;
+    int job_count, next_job;
+    lzw_monitor_t monitor;
+} pool_t;
+
+// each thread's work buffers (reused for every job, and only reallocated when a job needs more)
+
+typedef struct {
+    unsigned char *output, *buffer_output, *check;
+    size_t capacity;
+    lzw_thread_t thread;
+    pool_t *pool;
+} worker_t;
+
+typedef struct {
+    unsigned char *file_buffer;
+    size_t file_size;
+    int mapped;
+} loaded_file_t;
+
+typedef struct {
+    job_t *jobs;
+    loaded_file_t *files;
+    int job_count, jobs_allocated, file_count, files_allocated;
+    long long batch_bytes;
+    worker_t workers [MAX_THREADS];
+    int threads, checked, tests, skipped, errors;
+    unsigned long long total_input_bytes, total_output_bytes;
+} tester_t;
+
+static void free_buffers (worker_t *worker)
+{
+    free (worker->output);
+    free (worker->buffer_output);
+    free (worker->check);
+    worker->output = worker->buffer_output = worker->check = NULL;
+    worker->capacity = 0;
+}
+
+static int reserve_buffers (worker_t *worker, size_t size)
+{
+    if (worker->output && size <= worker->capacity)
+        return 1;
+
+    free_buffers (worker);
+    worker->output = malloc (size * 2 + 10);
+    worker->buffer_output = malloc (lzw_compress_bound (size, 16));
+    worker->check = malloc (size);
+
+    if (worker->output && worker->buffer_output && worker->check) {
+        worker->capacity = size;
+        return 1;
+    }
+
+    free_buffers (worker);
+    return 0;
+}
+
+#define STREAM_CHUNK        (1024 * 1024)
+#define STREAM_WINDOW       (4 * STREAM_CHUNK)
+
+// open a file and seek to a 64-bit "offset" (returns NULL on any failure)
+
+static FILE *open_file_at (const char *filename, unsigned long long offset)
+{
+    FILE *file = fopen (filename, "rb");
+
+#ifdef _WIN32
+    if (file && _fseeki64 (file, offset, SEEK_SET)) {
+#else
+    if (file && fseeko (file, offset, SEEK_SET)) {
+#endif
+        fclose (file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Compare "count" decoded bytes with the original data, like check_buff() does a byte at a time. The
+ * original data that hasn't been verified yet is in the "window" (with "window_offset" being the offset
+ * of its first byte in the data), and decoded bytes outside of it (which can only come from a corrupt
+ * stream) are counted as errors.
+ */
+
+static void check_block (streamer *checker, const unsigned char *decoded, size_t count,
+    const unsigned char *window, unsigned long long window_offset, size_t window_count)
+{
+    while (count) {
+        size_t bytes = count, i;
+
+        if (checker->index == checker->size) {
+            checker->wrapped += count;
+            return;
+        }
+
+        if (bytes > checker->size - checker->index)
+            bytes = (size_t) (checker->size - checker->index);
+
+        if (checker->index >= window_offset && checker->index < window_offset + window_count) {
+            const unsigned char *original = window + (checker->index - window_offset);
+
+            if (bytes > window_offset + window_count - checker->index)
+                bytes = (size_t) (window_offset + window_count - checker->index);
+
+            if (memcmp (decoded, original, bytes))
+                for (i = 0; i < bytes; ++i)
+                    if (decoded [i] != original [i] && !checker->byte_errors++)
+                        checker->first_error = checker->index + i;
+        }
+        else if (!checker->byte_errors)
+            checker->first_error = checker->index, checker->byte_errors = bytes;
+        else
+            checker->byte_errors += bytes;
+
+        checker->index += bytes;
+        decoded += bytes;
+        count -= bytes;
+    }
+}
+
+/* Test a file (or the part of it at "offset") by streaming it through the encoder and the decoder, which
+ * is done for files too big to load. Each chunk of the file is compressed, and each chunk of compressed
+ * data is decoded and compared as soon as it's generated. The decoder's output can only trail the input
+ * by the encoder's pending string (and bits), so the original data is kept only until it's verified (if
+ * a corrupt stream makes the decoder fall too far behind, decoding is abandoned). The results are stored
+ * just like the ones from run_job(), except there's no buffer function testing.
+ */
+
+static void stream_job (job_t *job)
+{
+    unsigned char *window = malloc (STREAM_WINDOW), *compressed = malloc (STREAM_CHUNK), *decoded = malloc (STREAM_CHUNK);
+    unsigned long long remaining = job->size, window_offset = 0;
+    FILE *infile = open_file_at (job->filename, job->offset);
+    streamer *checker = &job->checker, fuzzer;
+    int decoding = 1, decoder_done = 0, res;
+    size_t window_count = 0;
+    lzw_encoder_t enc;
+    lzw_decoder_t dec;
+
+    memset (checker, 0, sizeof (streamer));
+    memset (&fuzzer, 0, sizeof (streamer));
+    checker->size = job->size;
+    fuzzer.kernel = 0x3141592653589793ULL ^ (job->size << 8) ^ job->maxbits;
+
+    if (!window || !compressed || !decoded || lzw_encoder_init (&enc, job->maxbits)) {
+        job->no_memory = 1;
+        goto free_buffers;
+    }
+
+    if (lzw_decoder_init (&dec)) {
+        job->no_memory = 1;
+        goto free_encoder;
+    }
+
+    if (!infile) {
+        job->read_error = 1;
+        goto free_decoder;
+    }
+
+    while (1) {
+        size_t verified, read_bytes = remaining < STREAM_CHUNK ? (size_t) remaining : STREAM_CHUNK, in_index;
+
+        // drop the data that's been verified from the window, and then read the next chunk
+
+        verified = checker->index > window_offset + window_count ? window_count :
+            checker->index > window_offset ? (size_t) (checker->index - window_offset) : 0;
+        memmove (window, window + verified, window_count - verified);
+        window_offset += verified;
+        window_count -= verified;
+
+        if (window_count + read_bytes > STREAM_WINDOW) {
+            window_offset += window_count;
+            window_count = 0;
+            decoding = 0;
+        }
+
+        if (read_bytes && fread (window + window_count, 1, read_bytes, infile) != read_bytes) {
+            job->read_error = 1;
+            break;
+        }
+
+        remaining -= read_bytes;
+        in_index = window_count;
+        window_count += read_bytes;
+
+        // compress the chunk (or finish the stream), and decode and check each piece of output
+
+        do {
+            size_t in_bytes = window_count - in_index, out_bytes = STREAM_CHUNK, out_index = 0;
+
+            if (read_bytes)
+                res = lzw_encoder_feed (&enc, window + in_index, &in_bytes, compressed, &out_bytes);
+            else
+                res = lzw_encoder_finish (&enc, compressed, &out_bytes);
+
+            if (res == LZW_ERROR) {
+                job->compress_error = 1;
+                goto free_decoder;
+            }
+
+            in_index += in_bytes;
+            job->output_size += out_bytes;
+
+            if (job->output_size > job->size * 2 + 10) {
+                job->inflation = 1;
+                goto free_decoder;
+            }
+
+            if (job->fuzz_testing) {
+                size_t i;
+
+                for (i = 0; i < out_bytes; ++i)
+                    compressed [i] = fuzz_byte (&fuzzer, compressed [i]);
+            }
+
+            while (decoding && !decoder_done) {
+                size_t in_count = out_bytes - out_index, decoded_count = STREAM_CHUNK;
+                int decoder_res = lzw_decoder_feed (&dec, compressed + out_index, &in_count, decoded, &decoded_count);
+
+                out_index += in_count;
+                check_block (checker, decoded, decoded_count, window, window_offset, window_count);
+
+                if (decoder_res == LZW_ERROR)
+                    decoding = 0;
+                else if (decoder_res == LZW_DONE)
+                    decoder_done = 1;
+                else if (!in_count && !decoded_count)
+                    break;
+            }
+
+        } while (read_bytes ? in_index < window_count : res != LZW_DONE);
+
+        if (!read_bytes)
+            break;
+    }
+
+    job->res = !decoder_done;   // (the stream ended early, or the decoder failed or was abandoned)
+
+free_decoder:
+    lzw_decoder_finish (&dec);
+free_encoder:
+    lzw_encoder_free (&enc);
+free_buffers:
+    if (infile)
+        fclose (infile);
+
+    free (window);
+    free (compressed);
+    free (decoded);
+}
+
+static void run_job (job_t *job, worker_t *worker)
 {
-    int index, checked = 0, tests = 0, skipped = 0, errors = 0;
-    int set_maxbits = 0, quiet_mode = 0, exhaustive_mode = 0;
-    long long total_input_bytes = 0, total_output_bytes = 0;
-    streamer reader, writer, checker;
+    size_t buffer_output_size = lzw_compress_bound ((size_t) job->size, 16), buffer_output_bytes, buffer_check_bytes;
+    streamer reader, writer, *checker = &job->checker;
+    unsigned char *buffer_output, *buffer_check;
+
+    if (!job->data) {
+        stream_job (job);
+        return;
+    }
+
+    if (!reserve_buffers (worker, job->size)) {
+        job->no_memory = 1;
+        return;
+    }
+
+    buffer_output = worker->buffer_output;
+    buffer_check = worker->check;
 
     memset (&reader, 0, sizeof (reader));
     memset (&writer, 0, sizeof (writer));
-    memset (&checker, 0, sizeof (checker));
+    memset (checker, 0, sizeof (streamer));
+
+    reader.buffer = job->data;
+    reader.size = job->size;
+
+    writer.buffer = worker->output;
+    writer.size = job->size * 2 + 10;
+    writer.fuzz_testing = job->fuzz_testing;
+    writer.kernel = 0x3141592653589793ULL ^ ((unsigned long long) job->size << 8) ^ job->maxbits;
+
+    if (lzw_compress (write_buff, &writer, read_buff, &reader, job->maxbits)) {
+        job->compress_error = 1;
+        return;
+    }
+
+    if (writer.wrapped) {
+        job->inflation = 1;
+        return;
+    }
+
+    job->output_size = writer.index;
+    checker->buffer = job->data;
+    checker->size = job->size;
+
+    reader.buffer = writer.buffer;
+    reader.size = writer.index;
+    reader.index = 0;
+
+    job->res = lzw_decompress (check_buff, checker, read_buff, &reader);
+
+    // unless we're fuzzing, the buffer functions must generate the identical stream and decode it
+
+    if (!writer.fuzz_testing) {
+        buffer_output_bytes = buffer_output_size;
+        buffer_check_bytes = job->size;
+
+        if (lzw_compress_buffer (buffer_output, &buffer_output_bytes, job->data, job->size, job->maxbits) ||
+            buffer_output_bytes != writer.index || memcmp (buffer_output, writer.buffer, writer.index))
+                job->buffer_error = 1;
+        else if (lzw_decompress_buffer (buffer_check, &buffer_check_bytes, buffer_output, buffer_output_bytes) ||
+            buffer_check_bytes != job->size || memcmp (buffer_check, job->data, job->size))
+                job->buffer_error = 2;
+        else if (stream_test (job->data, job->size, writer.buffer, writer.index, job->maxbits))
+                job->buffer_error = 3;
+        else if (workspace_test (job->data, job->size, writer.buffer, writer.index, job->maxbits, buffer_check))
+                job->buffer_error = 4;
+        else if (dictionary_test (job->data, job->size, job->maxbits, buffer_check))
+                job->buffer_error = 5;
+        else if (flush_test (job->data, job->size, job->maxbits, buffer_check))
+                job->buffer_error = 6;
+        else if (checkpoint_test (job->data, job->size, writer.buffer, writer.index, job->maxbits, buffer_check))
+                job->buffer_error = 7;
+    }
+}
+
+static void report_job (tester_t *tester, const job_t *job)
+{
+    const streamer *checker = &job->checker;
+    int got_error;
+
+    if (job->first && !job->quiet_mode)
+        printf ("\n");
+
+    if (job->no_memory) {
+        printf ("\nnot enough memory to test file %s, maxbits = %d!\n", job->filename, job->maxbits);
+        tester->errors++;
+        return;
+    }
+
+    if (job->read_error) {
+        printf ("\nfile %s could not be read, maxbits = %d!\n", job->filename, job->maxbits);
+        tester->errors++;
+        return;
+    }
+
+    if (job->compress_error) {
+        printf ("\nlzw_compress() returned error on file %s, maxbits = %d\n", job->filename, job->maxbits);
+        tester->errors++;
+        return;
+    }
+
+    if (job->inflation) {
+        printf ("\nover 100%% inflation on file %s, maxbits = %d!\n", job->filename, job->maxbits);
+        tester->errors++;
+        return;
+    }
+
+    got_error = job->res || checker->index != checker->size || checker->wrapped || checker->byte_errors || job->buffer_error;
+
+    if (!job->quiet_mode || got_error)
+        printf ("file %s, maxbits = %2d: %llu bytes --> %llu bytes, %.2f%%\n", job->filename, job->maxbits,
+            job->size, job->output_size, job->output_size * 100.0 / job->size);
+
+    if (got_error) {
+        if (job->res)
+            printf ("decompressor returned an error\n");
+
+        if (job->buffer_error == 1)
+            printf ("lzw_compress_buffer() did not match lzw_compress()\n");
+        else if (job->buffer_error == 2)
+            printf ("lzw_decompress_buffer() did not return the original data\n");
+        else if (job->buffer_error == 3)
+            printf ("streaming functions did not match lzw_compress() or return the original data\n");
+        else if (job->buffer_error == 4)
+            printf ("workspace functions did not match lzw_compress() or return the original data\n");
+        else if (job->buffer_error == 5)
+            printf ("preset dictionary functions did not return the original data\n");
+        else if (job->buffer_error == 6)
+            printf ("flushed stream did not decode to the original data at every flush point\n");
+        else if (job->buffer_error == 7)
+            printf ("decoding from checkpoints did not return the rest of the original data\n");
+
+        if (!checker->index)
+            printf ("decompression didn't generate any data\n");
+        else if (checker->index != checker->size)
+            printf ("decompression terminated %llu bytes early\n", checker->size - checker->index);
+        else if (checker->wrapped)
+            printf ("decompression generated %llu extra bytes\n", checker->wrapped);
+
+        if (checker->byte_errors)
+            printf ("there were %llu byte data errors starting at index %llu\n",
+                checker->byte_errors, checker->first_error);
+        else if (checker->index != checker->size || checker->wrapped)
+            printf ("(but the data generated was all correct)\n");
+
+        printf ("\n");
+        tester->errors++;
+    }
+    else {
+        tester->total_input_bytes += job->size;
+        tester->total_output_bytes += job->output_size;
+    }
+
+    tester->tests++;
+}
+
+static void worker_thread (void *ctx)
+{
+    worker_t *worker = ctx;
+    pool_t *pool = worker->pool;
+
+    lzw_monitor_lock (&pool->monitor);
+
+    while (pool->next_job < pool->job_count) {
+        job_t *job = pool->jobs + pool->next_job++;
+
+        lzw_monitor_unlock (&pool->monitor);
+        run_job (job, worker);
+        lzw_monitor_lock (&pool->monitor);
+        job->done = 1;
+        lzw_monitor_notify (&pool->monitor);
+    }
+
+    lzw_monitor_unlock (&pool->monitor);
+}
+
+// run and report all the jobs of the batch (in order), and then release its files
+
+static void run_batch (tester_t *tester)
+{
+    int threads = tester->threads < tester->job_count ? tester->threads : tester->job_count, pooled, started = 0, i;
+    pool_t pool;
+
+    if ((pooled = threads > 1 && !lzw_monitor_init (&pool.monitor))) {
+        pool.jobs = tester->jobs;
+        pool.job_count = tester->job_count;
+        pool.next_job = 0;
+
+        for (i = 0; i < threads; ++i) {
+            tester->workers [i].pool = &pool;
+
+            if (!lzw_thread_create (&tester->workers [i].thread, worker_thread, tester->workers + i))
+                started++;
+            else
+                break;
+        }
+    }
+
+    if (started) {
+        for (i = 0; i < tester->job_count; ++i) {
+            lzw_monitor_lock (&pool.monitor);
+
+            while (!tester->jobs [i].done)
+                lzw_monitor_wait (&pool.monitor);
+
+            lzw_monitor_unlock (&pool.monitor);
+            report_job (tester, tester->jobs + i);
+            fflush (stdout);
+        }
+
+        while (started--)
+            lzw_thread_join (&tester->workers [started].thread);
+    }
+    else
+        for (i = 0; i < tester->job_count; ++i) {
+            run_job (tester->jobs + i, tester->workers);
+            report_job (tester, tester->jobs + i);
+        }
+
+    if (pooled)
+        lzw_monitor_free (&pool.monitor);
+
+    for (i = 0; i < tester->file_count; ++i)
+        release_file (tester->files [i].file_buffer, tester->files [i].file_size, tester->files [i].mapped);
+
+    tester->job_count = tester->file_count = 0;
+    tester->batch_bytes = 0;
+}
+
+static job_t *add_job (tester_t *tester)
+{
+    if (tester->job_count == tester->jobs_allocated) {
+        int count = tester->jobs_allocated ? tester->jobs_allocated * 2 : 256;
+        job_t *jobs = realloc (tester->jobs, count * sizeof (job_t));
+
+        if (!jobs)
+            return NULL;
+
+        tester->jobs = jobs;
+        tester->jobs_allocated = count;
+    }
+
+    memset (tester->jobs + tester->job_count, 0, sizeof (job_t));
+    return tester->jobs + tester->job_count++;
+}
+
+static int add_file (tester_t *tester, unsigned char *file_buffer, size_t file_size, int mapped)
+{
+    if (tester->file_count == tester->files_allocated) {
+        int count = tester->files_allocated ? tester->files_allocated * 2 : 64;
+        loaded_file_t *files = realloc (tester->files, count * sizeof (loaded_file_t));
+
+        if (!files)
+            return 0;
+
+        tester->files = files;
+        tester->files_allocated = count;
+    }
+
+    tester->files [tester->file_count].file_buffer = file_buffer;
+    tester->files [tester->file_count].file_size = file_size;
+    tester->files [tester->file_count++].mapped = mapped;
+    tester->batch_bytes += file_size;
+    return 1;
+}
+
+int main (int argc, char **argv)
+{
+    int index, set_maxbits = 0, quiet_mode = 0, exhaustive_mode = 0, fuzz_testing = 0, stream_mode = 0;
+    tester_t tester;
+
+    memset (&tester, 0, sizeof (tester));
+    tester.threads = 1;
 
     if (argc < 2) {
         printf ("%s", usage);
@@ -148,9 +1021,9 @@ int main (int argc, char **argv)
 
     for (index = 1; index < argc; ++index) {
         const char *filename = argv [index];
-        int test_size, bytes_read, maxbits;
-        unsigned char *file_buffer;
-        long long file_size;
+        int maxbits, mapped, first = 1;
+        unsigned char *file_buffer = NULL;
+        long long file_size, test_size;
         FILE *infile;
 
         if (!strcmp (filename, "-q")) {
@@ -164,7 +1037,25 @@ int main (int argc, char **argv)
         }
 
         if (!strcmp (filename, "-f")) {
-            writer.fuzz_testing = 1;
+            fuzz_testing = 1;
+            continue;
+        }
+
+        if (!strcmp (filename, "-s")) {
+            stream_mode = 1;
+            continue;
+        }
+
+        if (!strncmp (filename, "-j", 2)) {
+            char *end;
+
+            tester.threads = strtol (filename + 2, &end, 10);
+
+            if (end == filename + 2 || *end || tester.threads < 1 || tester.threads > MAX_THREADS) {
+                printf ("invalid thread count (1 - %d)!\n", MAX_THREADS);
+                return 1;
+            }
+
             continue;
         }
 
@@ -180,138 +1071,93 @@ int main (int argc, char **argv)
         infile = fopen (filename, "rb");
 
         if (!infile) {
+            run_batch (&tester);
             printf ("\ncan't open file %s!\n", filename);
-            skipped++;
+            tester.skipped++;
             continue;
         }
 
         file_size = DoGetFileSize (infile);
 
         if (!file_size) {
+            run_batch (&tester);
             printf ("\ncan't get file size of %s (may be zero)!\n", filename);
-            skipped++;
+            tester.skipped++;
             continue;
         }
 
-        if (file_size > 1024LL * 1024LL * 1024LL) {
-            printf ("\nfile %s is too big!\n", filename);
-            skipped++;
-            continue;
-        }
-
-        file_buffer = malloc (file_size);
-        writer.size = (unsigned int)(file_size * 2 + 10);
-        writer.buffer = malloc (writer.size);
+        if (stream_mode || file_size > 1024LL * 1024LL * 1024LL) {
+            fclose (infile);        // (streamed jobs open the file themselves, and don't count toward the batch bytes)
 
-        if (!file_buffer || !writer.buffer) {
-            printf ("\nfile %s is too big!\n", filename);
-            if (writer.buffer) free (writer.buffer);
-            if (file_buffer) free (file_buffer);
-            skipped++;
-            continue;
+            if (tester.job_count >= MAX_BATCH_JOBS)
+                run_batch (&tester);
         }
+        else {
+            if (tester.job_count >= MAX_BATCH_JOBS || tester.batch_bytes + file_size > MAX_BATCH_BYTES)
+                run_batch (&tester);
+
+            if (!(file_buffer = load_file (infile, (size_t) file_size, &mapped))) {
+                run_batch (&tester);
+                printf ("\nfile %s could not be read!\n", filename);
+                tester.skipped++;
+                continue;
+            }
 
-        bytes_read = fread (file_buffer, 1, (int) file_size, infile);
-        fclose (infile);
-
-        if (bytes_read != (int) file_size) {
-            printf ("\nfile %s could not be read!\n", filename);
-            free (writer.buffer);
-            free (file_buffer);
-            skipped++;
-            continue;
+            if (!add_file (&tester, file_buffer, (size_t) file_size, mapped)) {
+                run_batch (&tester);
+                release_file (file_buffer, (size_t) file_size, mapped);
+                printf ("\nfile %s is too big!\n", filename);
+                tester.skipped++;
+                continue;
+            }
         }
 
-        if (!quiet_mode)
-            printf ("\n");
-
         test_size = file_size;
-        checked++;
+        tester.checked++;
 
         do {
             for (maxbits = set_maxbits ? set_maxbits : 9; maxbits <= (set_maxbits ? set_maxbits : 16); ++maxbits) {
-                int res, got_error = 0;
+                job_t *job = add_job (&tester);
 
-                reader.buffer = file_buffer + (file_size - test_size) / 2;
-                reader.size = test_size;
-
-                reader.index = writer.index = writer.wrapped = 0;
-
-                if (lzw_compress (write_buff, &writer, read_buff, &reader, maxbits)) {
-                    printf ("\nlzw_compress() returned error on file %s, maxbits = %d\n", filename, maxbits);
-                    errors++;
-                    continue;
-                }
-
-                if (writer.wrapped) {
-                    printf ("\nover 100%% inflation on file %s, maxbits = %d!\n", filename, maxbits);
-                    errors++;
-                    continue;
+                if (!job) {
+                    printf ("\nout of memory!\n");
+                    return 1;
                 }
 
-                checker.buffer = reader.buffer;
-                checker.size = reader.size;
-                checker.wrapped = checker.byte_errors = checker.index = 0;
-
-                reader.buffer = writer.buffer;
-                reader.size = writer.index;
-                reader.index = 0;
-
-                res = lzw_decompress (check_buff, &checker, read_buff, &reader);
-
-                reader.buffer = checker.buffer;
-                reader.size = checker.size;
-
-                got_error = res || checker.index != checker.size || checker.wrapped || checker.byte_errors;
-
-                if (!quiet_mode || got_error)
-                    printf ("file %s, maxbits = %2d: %u bytes --> %u bytes, %.2f%%\n", filename, maxbits,
-                        reader.size, writer.index, writer.index * 100.0 / reader.size);
-
-                if (got_error) {
-                    if (res)
-                        printf ("decompressor returned an error\n");
-
-                    if (!checker.index)
-                        printf ("decompression didn't generate any data\n");
-                    else if (checker.index != checker.size)
-                        printf ("decompression terminated %u bytes early\n", checker.size - checker.index);
-                    else if (checker.wrapped)
-                        printf ("decompression generated %u extra bytes\n", checker.wrapped);
-
-                    if (checker.byte_errors)
-                        printf ("there were %u byte data errors starting at index %u\n",
-                            checker.byte_errors, checker.first_error);
-                    else if (checker.index != checker.size || checker.wrapped)
-                        printf ("(but the data generated was all correct)\n");
-
-                    printf ("\n");
-                    errors++;
-                }
-                else {
-                    total_input_bytes += reader.size;
-                    total_output_bytes += writer.index;
-                }
-
-                tests++;
+                job->filename = filename;
+                job->offset = (file_size - test_size) / 2;
+                job->data = file_buffer ? file_buffer + job->offset : NULL;
+                job->size = test_size;
+                job->maxbits = maxbits;
+                job->fuzz_testing = fuzz_testing;
+                job->quiet_mode = quiet_mode;
+                job->first = first;
+                first = 0;
 
                 if (exhaustive_mode)
                    test_size -= (test_size + 98) / 100;
             }
 
         } while (exhaustive_mode && test_size > 1 && test_size > file_size / 100);
-
-        free (writer.buffer);
-        free (file_buffer);
     }
 
-    if (errors)
-        printf ("\n***** %d errors detected in %d tests using %d files (%d skipped) *****\n\n", errors, tests, checked, skipped);
+    run_batch (&tester);
+
+    for (index = 0; index < MAX_THREADS; ++index)
+        free_buffers (tester.workers + index);
+
+    free (tester.jobs);
+    free (tester.files);
+
+    if (tester.errors)
+        printf ("\n***** %d errors detected in %d tests using %d files (%d skipped) *****\n\n",
+            tester.errors, tester.tests, tester.checked, tester.skipped);
     else {
-        printf ("\nsuccessfully ran %d tests using %d files (%d skipped) with no errors detected\n", tests, checked, skipped);
-        printf ("cumulative results: %llu bytes --> %llu bytes, %.2f%%\n\n", total_input_bytes, total_output_bytes,
-            total_output_bytes * 100.0 / total_input_bytes);
+        printf ("\nsuccessfully ran %d tests using %d files (%d skipped) with no errors detected\n",
+            tester.tests, tester.checked, tester.skipped);
+        printf ("cumulative results: %llu bytes --> %llu bytes, %.2f%%\n\n", tester.total_input_bytes,
+            tester.total_output_bytes, tester.total_output_bytes * 100.0 / tester.total_input_bytes);
     }
 
-    return errors;
+    return tester.errors;
 }
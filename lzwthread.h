@@ -0,0 +1,168 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZWTHREAD_H_
+#define LZWTHREAD_H_
+
+/* This is a minimal portable wrapper for the threads used by the framed
+ * (multithreaded) modes. It uses Win32 threads on Windows and POSIX threads
+ * everywhere else (so add -lpthread when building on those systems). The
+ * thread function has the same signature on both, and a non-zero return
+ * from lzw_thread_create() means that the thread could not be started (in
+ * which case the caller should simply run the function itself).
+ *
+ * There is also a mutex and condition variable (for the filter's pipelined
+ * I/O). On Windows these need Vista or later.
+ */
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef struct {
+    void (*function)(void *);
+    void *argument;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} lzw_thread_t;
+
+typedef struct {
+#ifdef _WIN32
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} lzw_monitor_t;
+
+#ifdef _WIN32
+
+static DWORD WINAPI lzw_thread_start (LPVOID thread)
+{
+    ((lzw_thread_t *) thread)->function (((lzw_thread_t *) thread)->argument);
+    return 0;
+}
+
+static inline int lzw_thread_create (lzw_thread_t *thread, void (*function)(void *), void *argument)
+{
+    thread->function = function;
+    thread->argument = argument;
+    thread->handle = CreateThread (NULL, 0, lzw_thread_start, thread, 0, NULL);
+    return thread->handle == NULL;
+}
+
+static inline void lzw_thread_join (lzw_thread_t *thread)
+{
+    WaitForSingleObject (thread->handle, INFINITE);
+    CloseHandle (thread->handle);
+}
+
+static inline int lzw_monitor_init (lzw_monitor_t *monitor)
+{
+    InitializeCriticalSection (&monitor->mutex);
+    InitializeConditionVariable (&monitor->cond);
+    return 0;
+}
+
+static inline void lzw_monitor_lock (lzw_monitor_t *monitor)
+{
+    EnterCriticalSection (&monitor->mutex);
+}
+
+static inline void lzw_monitor_unlock (lzw_monitor_t *monitor)
+{
+    LeaveCriticalSection (&monitor->mutex);
+}
+
+static inline void lzw_monitor_wait (lzw_monitor_t *monitor)
+{
+    SleepConditionVariableCS (&monitor->cond, &monitor->mutex, INFINITE);
+}
+
+static inline void lzw_monitor_notify (lzw_monitor_t *monitor)
+{
+    WakeAllConditionVariable (&monitor->cond);
+}
+
+static inline void lzw_monitor_free (lzw_monitor_t *monitor)
+{
+    DeleteCriticalSection (&monitor->mutex);
+}
+
+#else
+
+static void *lzw_thread_start (void *thread)
+{
+    ((lzw_thread_t *) thread)->function (((lzw_thread_t *) thread)->argument);
+    return NULL;
+}
+
+static inline int lzw_thread_create (lzw_thread_t *thread, void (*function)(void *), void *argument)
+{
+    thread->function = function;
+    thread->argument = argument;
+    return pthread_create (&thread->handle, NULL, lzw_thread_start, thread) != 0;
+}
+
+static inline void lzw_thread_join (lzw_thread_t *thread)
+{
+    pthread_join (thread->handle, NULL);
+}
+
+static inline int lzw_monitor_init (lzw_monitor_t *monitor)
+{
+    if (pthread_mutex_init (&monitor->mutex, NULL))
+        return 1;
+
+    if (pthread_cond_init (&monitor->cond, NULL)) {
+        pthread_mutex_destroy (&monitor->mutex);
+        return 1;
+    }
+
+    return 0;
+}
+
+static inline void lzw_monitor_lock (lzw_monitor_t *monitor)
+{
+    pthread_mutex_lock (&monitor->mutex);
+}
+
+static inline void lzw_monitor_unlock (lzw_monitor_t *monitor)
+{
+    pthread_mutex_unlock (&monitor->mutex);
+}
+
+static inline void lzw_monitor_wait (lzw_monitor_t *monitor)
+{
+    pthread_cond_wait (&monitor->cond, &monitor->mutex);
+}
+
+static inline void lzw_monitor_notify (lzw_monitor_t *monitor)
+{
+    pthread_cond_broadcast (&monitor->cond);
+}
+
+static inline void lzw_monitor_free (lzw_monitor_t *monitor)
+{
+    pthread_cond_destroy (&monitor->cond);
+    pthread_mutex_destroy (&monitor->mutex);
+}
+
+#endif
+
+#endif /* LZWTHREAD_H_ */
@@ -0,0 +1,432 @@
+////////////////////////////////////////////////////////////////////////////
+//                            **** LZW-AB ****                            //
+//               Adjusted Binary LZW Compressor/Decompressor              //
+//                  Copyright (c) 2016-2020 David Bryant                  //
+//                           All Rights Reserved                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lzwlib.h"
+
+/* This module provides a command-line program that builds a preset dictionary
+ * file from a set of sample messages (the files given, or pieces of them with -m),
+ * for use with lzw_dictionary_load() or "lzwfilter -P". The content is chosen the
+ * way the COVER algorithm does it: every 8-byte string ("d-mer") is scored by the
+ * number of samples it appears in, and then the sample data is divided into one
+ * "epoch" per segment and the 64-byte segment with the highest total score is taken
+ * from each, with the d-mers it covers scored zero after that (so they're not picked
+ * again). The segments are ordered with the best ones last, which is where they are
+ * least likely to be lost to the encoder's recycling.
+ *
+ * Finally, the samples are compressed with and without the new dictionary and the
+ * results are displayed, which gives an idea of what to expect for real messages
+ * (with the caveat that the samples themselves are obviously a best case).
+ */
+
+static const char *usage =
+" Usage:     lzwtrain [options] -o<dictfile> samplefile ...\n\n"
+" Options:   -1 ... -8 = maximum symbol size (9 - 16, default 12)\n"
+"            -s<n>     = dictionary content size in bytes (default symbols - 257)\n"
+"            -m<n>     = split the sample files into messages of n bytes\n"
+"            -i<n>     = dictionary id (default is a hash of the content)\n"
+"            -o<file>  = dictionary file to write\n"
+"            -q        = quiet (don't evaluate the dictionary)\n\n"
+" Web:       Visit www.github.com/dbry/lzw-ab for latest version and info\n\n";
+
+#define DMER_SIZE       8
+#define SEGMENT_SIZE    64
+#define HASH_BITS       20
+#define HASH_SIZE       (1 << HASH_BITS)
+#define NO_DMER         0xffffffff
+
+typedef struct {
+    size_t offset;
+    unsigned long long score;
+} segment_t;
+
+static unsigned int hash_dmer (const unsigned char *p)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 0; i < DMER_SIZE; ++i)
+        value |= (unsigned long long) p [i] << (i * 8);
+
+    return (unsigned int) ((value * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_BITS));
+}
+
+static unsigned int fnv1a (const unsigned char *p, size_t size)
+{
+    unsigned int hash = 2166136261U;
+
+    while (size--)
+        hash = (hash ^ *p++) * 16777619U;
+
+    return hash;
+}
+
+static int compare_segments (const void *a, const void *b)
+{
+    const segment_t *sa = a, *sb = b;
+
+    if (sa->score != sb->score)
+        return sa->score < sb->score ? -1 : 1;
+
+    return sa->offset < sb->offset ? -1 : sa->offset > sb->offset;
+}
+
+// Load all the sample files into one buffer, recording where each sample starts ("starts" has
+// num_samples + 1 entries, the last being the total size). Returns the number of samples or -1.
+
+static int load_samples (char **filenames, int num_files, size_t message_size, unsigned char **data, size_t **starts)
+{
+    size_t total = 0, num_samples = 0, capacity = 0;
+    int i;
+
+    *data = NULL;
+    *starts = NULL;
+
+    for (i = 0; i < num_files; ++i) {
+        FILE *file = fopen (filenames [i], "rb");
+        size_t file_size, offset;
+        long size;
+
+        if (!file || fseek (file, 0, SEEK_END) || (size = ftell (file)) < 0 || fseek (file, 0, SEEK_SET)) {
+            fprintf (stderr, "can't read file %s!\n", filenames [i]);
+            if (file) fclose (file);
+            return -1;
+        }
+
+        file_size = size;
+        *data = realloc (*data, total + file_size + 1);
+
+        if (!*data || fread (*data + total, 1, file_size, file) != file_size) {
+            fprintf (stderr, "can't read file %s!\n", filenames [i]);
+            fclose (file);
+            return -1;
+        }
+
+        fclose (file);
+
+        for (offset = 0; offset < file_size; offset += message_size ? message_size : file_size) {
+            if (num_samples + 2 > capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                *starts = realloc (*starts, capacity * sizeof (size_t));
+
+                if (!*starts) {
+                    fprintf (stderr, "out of memory!\n");
+                    return -1;
+                }
+            }
+
+            (*starts) [num_samples++] = total + offset;
+        }
+
+        total += file_size;
+    }
+
+    if (!num_samples || num_samples > 0x7fffffff) {
+        fprintf (stderr, "no samples!\n");
+        return -1;
+    }
+
+    (*starts) [num_samples] = total;
+    return (int) num_samples;
+}
+
+// Build the dictionary content from the samples, returning its size (which is at most "size").
+
+static size_t build_content (const unsigned char *data, const size_t *starts, int num_samples, unsigned char *content, size_t size)
+{
+    size_t total = starts [num_samples], num_segments = (size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+    size_t epoch_size, content_size = 0, count = 0, epoch, pos;
+    unsigned int *counts = calloc (HASH_SIZE, sizeof (unsigned int));
+    unsigned int *last = malloc (HASH_SIZE * sizeof (unsigned int));
+    unsigned int *hashes = malloc ((total + 1) * sizeof (unsigned int));
+    segment_t *segments = malloc (num_segments * sizeof (segment_t));
+    int sample;
+
+    if (!counts || !last || !hashes || !segments) {
+        fprintf (stderr, "out of memory!\n");
+        free (counts); free (last); free (hashes); free (segments);
+        return 0;
+    }
+
+    // hash every d-mer that doesn't cross a sample boundary, and count it once per sample
+
+    memset (last, 0xff, HASH_SIZE * sizeof (unsigned int));
+
+    for (sample = 0; sample < num_samples; ++sample)
+        for (pos = starts [sample]; pos < starts [sample + 1]; ++pos)
+            if (pos + DMER_SIZE <= starts [sample + 1]) {
+                unsigned int hash = hashes [pos] = hash_dmer (data + pos);
+
+                if (last [hash] != (unsigned int) sample) {
+                    last [hash] = sample;
+                    counts [hash]++;
+                }
+            }
+            else
+                hashes [pos] = NO_DMER;
+
+    // take the best segment from each epoch (a segment's score is that of the d-mers entirely within it)
+
+    epoch_size = total / num_segments;
+
+    if (epoch_size < SEGMENT_SIZE)
+        epoch_size = SEGMENT_SIZE;
+
+    for (epoch = 0; epoch < total && count < num_segments; epoch += epoch_size) {
+        size_t end = epoch + epoch_size > total ? total : epoch + epoch_size, best = 0, i;
+        unsigned long long score = 0, best_score = 0;
+
+        if (end - epoch < SEGMENT_SIZE)
+            break;
+
+        for (pos = epoch; pos < end; ++pos) {
+            if (hashes [pos] != NO_DMER)
+                score += counts [hashes [pos]];
+
+            if (pos >= epoch + SEGMENT_SIZE - DMER_SIZE + 1) {
+                size_t drop = pos - (SEGMENT_SIZE - DMER_SIZE + 1);
+
+                if (hashes [drop] != NO_DMER)
+                    score -= counts [hashes [drop]];
+            }
+
+            if (pos + DMER_SIZE <= end && pos >= epoch + SEGMENT_SIZE - DMER_SIZE && score > best_score) {
+                best_score = score;
+                best = pos - (SEGMENT_SIZE - DMER_SIZE);
+            }
+        }
+
+        if (best_score < 2 * (SEGMENT_SIZE - DMER_SIZE + 1))    // only d-mers found in one sample
+            continue;
+
+        segments [count].offset = best;
+        segments [count++].score = best_score;
+
+        for (i = best; i <= best + SEGMENT_SIZE - DMER_SIZE; ++i)
+            if (hashes [i] != NO_DMER)
+                counts [hashes [i]] = 0;
+    }
+
+    qsort (segments, count, sizeof (segment_t), compare_segments);
+
+    for (pos = 0; pos < count && content_size + SEGMENT_SIZE <= size; ++pos) {
+        memcpy (content + content_size, data + segments [pos].offset, SEGMENT_SIZE);
+        content_size += SEGMENT_SIZE;
+    }
+
+    free (counts); free (last); free (hashes); free (segments);
+    return content_size;
+}
+
+static int write_dictionary (const char *filename, const unsigned char *content, size_t content_size, int maxbits, unsigned int id)
+{
+    unsigned char header [LZW_DICTIONARY_HEADER_SIZE];
+    FILE *file = fopen (filename, "wb");
+    int i;
+
+    memcpy (header, LZW_DICTIONARY_MAGIC, 4);
+    header [4] = 1;
+    header [5] = maxbits;
+    header [6] = header [7] = 0;
+
+    for (i = 0; i < 4; ++i) {
+        header [8 + i] = (unsigned char) (id >> (i * 8));
+        header [12 + i] = (unsigned char) (content_size >> (i * 8));
+    }
+
+    if (!file || fwrite (header, 1, sizeof (header), file) != sizeof (header) ||
+        fwrite (content, 1, content_size, file) != content_size || fclose (file)) {
+            fprintf (stderr, "can't write dictionary file %s!\n", filename);
+            return 1;
+    }
+
+    return 0;
+}
+
+// compress each sample with and without the dictionary (verifying the results) and report the totals
+
+static int evaluate (const unsigned char *data, const size_t *starts, int num_samples, const lzw_dictionary_t *dictionary, int maxbits)
+{
+    size_t plain_bytes = 0, dict_bytes = 0, max_size = 0, size;
+    double plain_time = 0.0, dict_time = 0.0;
+    unsigned char *compressed, *decompressed;
+    int sample, error = 0;
+
+    for (sample = 0; sample < num_samples; ++sample)
+        if (starts [sample + 1] - starts [sample] > max_size)
+            max_size = starts [sample + 1] - starts [sample];
+
+    compressed = malloc (lzw_compress_bound (max_size, maxbits) + LZW_DICTIONARY_OVERHEAD);
+    decompressed = malloc (max_size + 1);
+
+    if (!compressed || !decompressed) {
+        fprintf (stderr, "out of memory!\n");
+        free (compressed); free (decompressed);
+        return 1;
+    }
+
+    for (sample = 0; sample < num_samples && !error; ++sample) {
+        size_t sample_size = starts [sample + 1] - starts [sample], dst_size;
+        const unsigned char *src = data + starts [sample];
+        clock_t start = clock ();
+
+        size = lzw_compress_bound (sample_size, maxbits);
+        error |= lzw_compress_buffer (compressed, &size, src, sample_size, maxbits);
+        plain_time += (double) (clock () - start) / CLOCKS_PER_SEC;
+        plain_bytes += size;
+
+        start = clock ();
+        size = lzw_compress_bound (sample_size, maxbits) + LZW_DICTIONARY_OVERHEAD;
+        error |= lzw_compress_buffer_dict (compressed, &size, src, sample_size, dictionary);
+        dict_time += (double) (clock () - start) / CLOCKS_PER_SEC;
+        dict_bytes += size;
+
+        dst_size = max_size + 1;
+
+        if (error || lzw_decompress_buffer_dict (decompressed, &dst_size, compressed, size, dictionary) ||
+            dst_size != sample_size || memcmp (decompressed, src, sample_size)) {
+                fprintf (stderr, "dictionary failed on sample %d!\n", sample);
+                error = 1;
+        }
+    }
+
+    if (!error) {
+        fprintf (stderr, "%d samples, %lu bytes\n", num_samples, (unsigned long) starts [num_samples]);
+        fprintf (stderr, "without dictionary: %lu bytes (%.2f%%), %.2f us per message\n", (unsigned long) plain_bytes,
+            plain_bytes * 100.0 / starts [num_samples], plain_time * 1e6 / num_samples);
+        fprintf (stderr, "   with dictionary: %lu bytes (%.2f%%), %.2f us per message\n", (unsigned long) dict_bytes,
+            dict_bytes * 100.0 / starts [num_samples], dict_time * 1e6 / num_samples);
+    }
+
+    free (compressed);
+    free (decompressed);
+    return error;
+}
+
+int main (int argc, char **argv)
+{
+    int maxbits = 12, quiet = 0, error = 0, num_files = 0, num_samples, have_id = 0;
+    size_t content_size = 0, message_size = 0;
+    char **filenames = malloc (argc * sizeof (char *)), *outfile = NULL, *end;
+    unsigned char *data, *content;
+    lzw_dictionary_t *dictionary;
+    unsigned int id = 0;
+    size_t *starts;
+
+    while (--argc) {
+        if ((**++argv == '-') && (*argv)[1])
+            while (*++*argv)
+                switch (**argv) {
+                    case '1': case '2': case '3': case '4':
+                    case '5': case '6': case '7': case '8':
+                        maxbits = **argv - '0' + 8;
+                        break;
+
+                    case 's':
+                        content_size = strtoul (*argv + 1, &end, 10);
+
+                        if (end == *argv + 1 || !content_size || content_size > 0x1000000) {
+                            fprintf (stderr, "invalid dictionary size!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        break;
+
+                    case 'm':
+                        message_size = strtoul (*argv + 1, &end, 10);
+
+                        if (end == *argv + 1 || !message_size) {
+                            fprintf (stderr, "invalid message size!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        break;
+
+                    case 'i':
+                        id = (unsigned int) strtoul (*argv + 1, &end, 0);
+
+                        if (end == *argv + 1) {
+                            fprintf (stderr, "invalid dictionary id!\n");
+                            error = 1;
+                        }
+
+                        *argv = end - 1;
+                        have_id = 1;
+                        break;
+
+                    case 'o':
+                        outfile = *argv + 1;
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'q': case 'Q':
+                        quiet = 1;
+                        break;
+
+                    default:
+                        fprintf (stderr, "illegal option: %c !\n", **argv);
+                        error = 1;
+                        break;
+                }
+        else
+            filenames [num_files++] = *argv;
+    }
+
+    if (error || !outfile || !*outfile || !num_files) {
+        fprintf (stderr, "%s", usage);
+        return 1;
+    }
+
+    // by default, use no more content than there are codes for strings, so the dictionary can't fill (each
+    // byte adds at most one string) and the new strings in a message don't have to recycle entries (which
+    // is slower than starting with an empty dictionary, and would lose the benefit for latency)
+
+    if (!content_size)
+        content_size = ((size_t) 1 << maxbits) - 257;
+
+    if ((num_samples = load_samples (filenames, num_files, message_size, &data, &starts)) < 0)
+        return 1;
+
+    content = malloc (content_size);
+
+    if (!content || !(content_size = build_content (data, starts, num_samples, content, content_size))) {
+        fprintf (stderr, "no content found for the dictionary (too few or dissimilar samples?)\n");
+        return 1;
+    }
+
+    if (!have_id)
+        id = fnv1a (content, content_size);
+
+    if (write_dictionary (outfile, content, content_size, maxbits, id))
+        return 1;
+
+    if (!quiet)
+        fprintf (stderr, "wrote %s: %lu bytes of content, maxbits = %d, id = 0x%08x\n", outfile, (unsigned long) content_size, maxbits, id);
+
+    if (!quiet) {
+        if (!(dictionary = lzw_dictionary_create (content, content_size, maxbits, id))) {
+            fprintf (stderr, "can't create dictionary!\n");
+            return 1;
+        }
+
+        error = evaluate (data, starts, num_samples, dictionary, maxbits);
+        lzw_dictionary_free (dictionary);
+    }
+
+    free (filenames);
+    free (content);
+    free (starts);
+    free (data);
+    return error;
+}